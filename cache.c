@@ -0,0 +1,101 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  parsed image cache
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	Parsed text images are kept as pre-framed containers named after the
+	hash of the source file contents, so an unchanged source is never
+	parsed twice and every process flashing it maps the same file. The
+	containers are written under a temporary name and renamed into place,
+	so concurrent stations never see half a file.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "framed.h"
+
+extern FILE *fp_stderr;
+
+/* 64 bit FNV-1a over the file contents */
+static int cache_hash(const char *source, uint64_t *hash) {
+	uint8_t	buf[65536];
+	size_t	n, i;
+	FILE	*fp = fopen(source, "rb");
+
+	if (!fp)
+		return 1;
+
+	*hash = 0xcbf29ce484222325ULL;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		for (i = 0; i < n; ++i)
+			*hash = (*hash ^ buf[i]) * 0x100000001b3ULL;
+
+	i = ferror(fp);
+	fclose(fp);
+	return i != 0;
+}
+
+int cache_path(const char *dir, const char *source, char *path, unsigned int len) {
+	uint64_t hash;
+
+	if (cache_hash(source, &hash) != 0)
+		return 1;
+
+	return snprintf(path, len, "%s/%08x%08x.s8f", dir,
+		(unsigned int)(hash >> 32), (unsigned int)hash) >= (int)len;
+}
+
+/* open the cached container, non zero if there is none */
+int cache_lookup(const char *path, parser_t **pp, void **pst) {
+	void *st;
+
+	if (access(path, R_OK) != 0)
+		return 1;
+
+	if (!(st = PARSER_FRAMED.init()))
+		return 1;
+
+	if (PARSER_FRAMED.open(st, path, 0) != PARSER_ERR_OK) {
+		PARSER_FRAMED.close(st);
+		return 1;
+	}
+
+	*pp  = &PARSER_FRAMED;
+	*pst = st;
+	return 0;
+}
+
+/* store a parsed image, a failure only costs the parse next time */
+int cache_store(const char *path, parser_t *parser, void *storage) {
+	char		tmp[CACHE_PATH_MAX + 16];
+	parser_iter_t	it;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	parser_iter_init(&it, parser, storage, 0);
+	if (framed_compile(&it, tmp) != 0 || rename(tmp, path) != 0) {
+		fprintf(fp_stderr, "Could not store %s in the image cache\n", path);
+		unlink(tmp);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,33 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  parsed image cache
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include "parser.h"
+
+/* cache file name for a source image, "<dir>/<content hash>.s8f" */
+#define CACHE_PATH_MAX	4096
+
+int cache_path  (const char *dir, const char *source, char *path, unsigned int len);
+int cache_lookup(const char *path, parser_t **pp, void **pst);
+int cache_store (const char *path, parser_t *parser, void *storage);
+
+#endif
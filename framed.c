@@ -0,0 +1,313 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  pre-framed image container
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef __WIN32__
+#include <sys/mman.h>
+#endif
+
+#include "framed.h"
+#include "utils.h"
+#include "parsers/image.h"
+
+typedef struct {
+	uint8_t		*map;
+	size_t		map_len;
+	unsigned int	count;
+	uint32_t	offset;		/* read position, as an address */
+	unsigned int	rseg;		/* block at or after the read position */
+} framed_t;
+
+extern FILE *fp_stderr;
+
+static void put_le16(uint8_t *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+static uint16_t get_le16(const uint8_t *p) {
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+	return get_le16(p) | (uint32_t)get_le16(p + 2) << 16;
+}
+
+static const uint8_t *framed_record(const framed_t *st, unsigned int index) {
+	return st->map + FRAMED_HEADER_SIZE + index * FRAMED_RECORD_SIZE;
+}
+
+/* fill in a record for the block at address, data holds len bytes */
+static void framed_fill(uint8_t *rec, uint32_t address, const uint8_t *data, unsigned int len) {
+	unsigned int i;
+
+	memset(rec, 0, FRAMED_RECORD_SIZE);
+	put_le32(rec, address);
+	put_le16(rec + 4, crc16(0xffff, data, len));
+	rec[6] = len;
+	for (i = 0; i < len && !data[i]; ++i);
+	rec[7] = i == len ? FRAMED_ZERO : 0;
+	stm8_frame_write(address, data, len, rec + 8, rec + 8 + STM8_ADDR_FRAME);
+}
+
+/* append a record to the table, growing it as needed */
+static int framed_add(uint8_t **recs, unsigned int *count, unsigned int *alloc,
+	uint32_t address, const uint8_t *data, unsigned int len)
+{
+	uint8_t *p;
+
+	if (*count == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 256;
+		if (!(p = realloc(*recs, *alloc * FRAMED_RECORD_SIZE)))
+			return 1;
+		*recs = p;
+	}
+	framed_fill(*recs + (*count)++ * FRAMED_RECORD_SIZE, address, data, len);
+	return 0;
+}
+
+/*
+	cut the image into blocks the way write_segments does: one record per
+	128 byte block holding data, covering the data from its first to its
+	last byte with zero in any gap between. Below the flash the gaps are
+	bytes of EEPROM or option bytes that must be left alone, so there each
+	piece of data gets a record of its own
+*/
+int framed_compile(parser_iter_t *it, const char *filename) {
+	parser_iter_t	look;
+	parser_blocks_t	bs;
+	parser_block_t	b;
+	parser_seg_t	seg;
+	uint8_t		header[FRAMED_HEADER_SIZE];
+	uint8_t		*recs = NULL;
+	unsigned int	count = 0, alloc = 0;
+	uint32_t	from, to, end;
+	FILE		*fp;
+	int		ret = 1;
+
+	for (look = *it; parser_next(&look, &seg) == PARSER_ERR_OK && seg.address < FRAMED_FLASH_START; ) {
+		end = seg.address + seg.len < FRAMED_FLASH_START ? seg.address + seg.len : FRAMED_FLASH_START;
+		for (from = seg.address; from < end; from = to) {
+			to = from - from % FRAMED_BLOCK + FRAMED_BLOCK;
+			to = to < end ? to : end;
+			if (framed_add(&recs, &count, &alloc, from, &seg.data[from - seg.address], to - from) != 0) {
+				fprintf(fp_stderr, "Out of memory building %s\n", filename);
+				goto out;
+			}
+		}
+	}
+
+	parser_blocks_init(&bs, it->parser, it->storage, it->base, FRAMED_FLASH_START, UINT32_MAX);
+	while (parser_next_block(&bs, &b) == PARSER_ERR_OK)
+		if (framed_add(&recs, &count, &alloc, b.address + b.first, b.data, b.last - b.first) != 0) {
+			fprintf(fp_stderr, "Out of memory building %s\n", filename);
+			goto out;
+		}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, FRAMED_MAGIC, 8);
+	put_le32(header + 8, count);
+	put_le16(header + 12, FRAMED_RECORD_SIZE);
+	put_le16(header + 14, crc16(0xffff, recs, count * FRAMED_RECORD_SIZE));
+
+	if (!(fp = fopen(filename, "wb"))) {
+		perror(filename);
+		goto out;
+	}
+	if (fwrite(header, sizeof(header), 1, fp) != 1 ||
+	    (count && fwrite(recs, FRAMED_RECORD_SIZE, count, fp) != count)) {
+		perror(filename);
+		fclose(fp);
+		goto out;
+	}
+	if (fclose(fp) != 0) {
+		perror(filename);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(recs);
+	return ret;
+}
+
+void* framed_init() {
+	return calloc(sizeof(framed_t), 1);
+}
+
+parser_err_t framed_open(void *storage, const char *filename, const char write) {
+	framed_t	*st = storage;
+	const uint8_t	*rec;
+	uint32_t	end = 0;
+	unsigned int	i;
+
+	if (write)
+		return PARSER_ERR_RDONLY;
+
+#ifndef __WIN32__
+	{
+		struct stat	sb;
+		int		fd = open(filename, O_RDONLY);
+
+		if (fd < 0)
+			return PARSER_ERR_SYSTEM;
+		if (fstat(fd, &sb) != 0) {
+			close(fd);
+			return PARSER_ERR_SYSTEM;
+		}
+		if (sb.st_size < FRAMED_HEADER_SIZE) {
+			close(fd);
+			return PARSER_ERR_INVALID_FILE;
+		}
+
+		st->map_len = sb.st_size;
+		st->map     = mmap(NULL, st->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (st->map == MAP_FAILED) {
+			st->map = NULL;
+			return PARSER_ERR_SYSTEM;
+		}
+	}
+#else
+	{
+		FILE *fp = fopen(filename, "rb");
+		long size;
+
+		if (!fp)
+			return PARSER_ERR_SYSTEM;
+		fseek(fp, 0, SEEK_END);
+		size = ftell(fp);
+		rewind(fp);
+		st->map_len = size;
+		if (size < FRAMED_HEADER_SIZE || !(st->map = malloc(size)) || fread(st->map, size, 1, fp) != 1) {
+			fclose(fp);
+			return size < FRAMED_HEADER_SIZE ? PARSER_ERR_INVALID_FILE : PARSER_ERR_SYSTEM;
+		}
+		fclose(fp);
+	}
+#endif
+
+	if (st->map_len < FRAMED_HEADER_SIZE || memcmp(st->map, FRAMED_MAGIC, 8) != 0)
+		return PARSER_ERR_INVALID_FILE;
+
+	/* from here on it is a container, a bad one must not be taken for another format */
+	st->count = get_le32(st->map + 8);
+	if (get_le16(st->map + 12) != FRAMED_RECORD_SIZE ||
+	    st->count > (st->map_len - FRAMED_HEADER_SIZE) / FRAMED_RECORD_SIZE ||
+	    st->map_len != FRAMED_HEADER_SIZE + (size_t)st->count * FRAMED_RECORD_SIZE ||
+	    get_le16(st->map + 14) != crc16(0xffff, st->map + FRAMED_HEADER_SIZE, st->count * FRAMED_RECORD_SIZE))
+		return PARSER_ERR_DAMAGED;
+
+	/* blocks are sorted and fit the block buffers of the writers */
+	for (i = 0; i < st->count; ++i) {
+		rec = framed_record(st, i);
+		if (rec[6] == 0 || rec[6] > FRAMED_BLOCK || get_le32(rec) < end)
+			return PARSER_ERR_DAMAGED;
+		end = get_le32(rec) + rec[6];
+	}
+
+	return PARSER_ERR_OK;
+}
+
+parser_err_t framed_close(void *storage) {
+	framed_t *st = storage;
+
+	if (st && st->map) {
+#ifndef __WIN32__
+		munmap(st->map, st->map_len);
+#else
+		free(st->map);
+#endif
+	}
+	free(st);
+	return PARSER_ERR_OK;
+}
+
+unsigned int framed_count(void *storage) {
+	framed_t *st = storage;
+	return st->count;
+}
+
+void framed_get(void *storage, unsigned int index, framed_block_t *block) {
+	framed_t *st = storage;
+	const uint8_t *rec = framed_record(st, index);
+
+	block->address		= get_le32(rec);
+	block->crc		= get_le16(rec + 4);
+	block->len		= rec[6];
+	block->flags		= rec[7];
+	block->addr_frame	= rec + 8;
+	block->data_frame	= rec + 8 + STM8_ADDR_FRAME;
+}
+
+unsigned int framed_size(void *storage) {
+	framed_t *st = storage;
+	const uint8_t *rec;
+
+	if (!st->count) return 0;
+	rec = framed_record(st, st->count - 1);
+	return get_le32(rec) + rec[6];
+}
+
+/* each block is a segment, its data is inside the data frame */
+parser_err_t framed_segment(void *storage, unsigned int index, parser_seg_t *seg) {
+	framed_t *st = storage;
+	framed_block_t block;
+
+	if (index >= st->count) return PARSER_ERR_END;
+
+	framed_get(storage, index, &block);
+	seg->address	= block.address;
+	seg->len	= block.len;
+	seg->data	= block.data_frame + 1;
+	return PARSER_ERR_OK;
+}
+
+/* read the flat image from address 0, the gaps between blocks read as 0xff */
+parser_err_t framed_read(void *storage, void *data, unsigned int *len) {
+	framed_t *st = storage;
+	return image_read_segments(framed_segment, storage, &st->offset, &st->rseg, data, len);
+}
+
+parser_err_t framed_write(void *storage, uint32_t address, void *data, unsigned int len) {
+	return PARSER_ERR_RDONLY;
+}
+
+parser_t PARSER_FRAMED = {
+	"Pre-framed image",
+	framed_init,
+	framed_open,
+	framed_close,
+	framed_size,
+	framed_read,
+	framed_write,
+	framed_segment,
+	NULL
+};
@@ -0,0 +1,66 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  pre-framed image container
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _FRAMED_H
+#define _FRAMED_H
+
+#include <stdint.h>
+#include "parser.h"
+#include "stm8.h"
+
+/*
+	A container holds an image cut into 128 byte aligned blocks, each with
+	the WRITE frames already built, so a station only maps the file and
+	sends it. All numbers are little endian.
+
+	header	magic[8] "STM8FRM1", u32 block count, u16 record size,
+		u16 CRC-16 of all the records
+	record	u32 address, u16 CRC-16 of the data, u8 length, u8 flags,
+		address frame[5], data frame[130], one byte padding
+
+	The records are checked by the one CRC in the header when the
+	container is opened, their frames are then sent as they are.
+*/
+#define FRAMED_MAGIC		"STM8FRM1"
+#define FRAMED_BLOCK		128
+#define FRAMED_HEADER_SIZE	16
+#define FRAMED_RECORD_SIZE	144
+#define FRAMED_FLASH_START	0x8000	/* gaps are only filled in blocks from here on */
+
+#define FRAMED_ZERO		0x01	/* flags: the block is all zero, nothing to write after an erase */
+
+typedef struct framed_block framed_block_t;
+
+struct framed_block {
+	uint32_t	address;
+	uint16_t	crc;
+	uint8_t		len;
+	uint8_t		flags;
+	const uint8_t	*addr_frame;
+	const uint8_t	*data_frame;	/* the data starts at data_frame + 1 */
+};
+
+extern parser_t PARSER_FRAMED;
+
+int          framed_compile(parser_iter_t *it, const char *filename);
+unsigned int framed_count  (void *storage);
+void         framed_get    (void *storage, unsigned int index, framed_block_t *block);
+
+#endif
@@ -21,146 +21,1829 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#ifndef __WIN32__
+#include <sys/mman.h>
+#endif
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
+#include <signal.h>
+
+#include "utils.h"
+#include "serial.h"
+#include "stm8.h"
+#include "parser.h"
+#include "optbytes.h"
+#include "framed.h"
+#include "cache.h"
+#include "patch.h"
+#include "unit.h"
+#include "trace.h"
+
+#ifdef LANTRONIX_CPM
+#endif
+
+#include "parsers/binary.h"
+#include "parsers/hex.h"
+#include "parsers/srec.h"
+#include "parsers/elf.h"
+
+FILE *fp_stdout;
+FILE *fp_stderr;
+
+/* device globals */
+serial_t	*serial		= NULL;
+stm8_t		*stm		= NULL;
+
+/* operations, run in order over one session */
+typedef enum {
+	OP_READ,		/* read memory to file */
+	OP_WRITE,		/* erase and write an image */
+	OP_EE_READ,		/* read the data EEPROM to file */
+	OP_EE_WRITE,		/* write the changed data EEPROM bytes */
+	OP_ERASE,		/* erase flash sectors */
+	OP_OPTIONS,		/* show and/or modify the option bytes */
+	OP_RAM_LOAD,		/* load an image into RAM and start it */
+	OP_VERIFY,		/* switch verification of the following writes */
+	OP_AUDIT		/* compare regions against a manifest of CRCs */
+} op_type_t;
+
+typedef enum {
+	ERASE_NONE,
+	ERASE_ALL,		/* erase npages (default all) before writing */
+	ERASE_RANGE		/* erase only the sectors that are written */
+} op_erase_t;
+
+typedef struct {
+	op_type_t	type;
+	char		*filename;
+	char		range_flag;
+	uint32_t	range_start;
+	uint32_t	range_len;
+	op_erase_t	erase;
+	char		value;		/* OP_VERIFY: off/on/after, OP_OPTIONS: show */
+	int		nassign;	/* OP_OPTIONS: name=value list */
+	char		*assign[16];
+	parser_t	*parser;
+	void		*p_st;
+	char		*text;		/* script line the strings above point into */
+} op_t;
+
+op_t		ops[64];
+int		op_count	= 0;
+
+/* settings */
+char		*device		= NULL;
+serial_baud_t	baudRate	= SERIAL_BAUD_115200;
+int		rd	 	= 0;
+int		wr		= 0;
+int		wu		= 0;
+int 		eb 		= 0;
+int		dtr_reset	= 0;
+int		cpm_reset_flag	= 0;
+int 	        redirect_stderr_stdout = 0;
+int		ee_rd		= 0;
+int		ee_wr		= 0;
+
+int		npages		= 0xFF;
+char		verify		= 0;
+char		verify_after	= 0;	/* verify the flash once the whole image is written */
+char		show_stats	= 0;	/* print the command statistics when done */
+char		*trace_filename	= NULL;	/* record the serial line to this file */
+int		retry		= 10;
+char		exec_flag	= 0;
+uint32_t	execute		= 0;
+char		init_flag	= 1;
+char		force_binary	= 0;
+char		skip_erased	= 0;
+char		reset_flag	= 1;
+char		range_flag	= 0;
+uint32_t	range_start	= 0;
+uint32_t	range_len	= 0;
+char		*filename;
+char		*ee_filename;
+char		*script;
+char		script_go	= 0;	/* the script ends with go */
+char		*ram_filename;
+char		*compile_filename;
+char		*cache_dir;
+char		*patch_filename;
+patch_t		*patch;
+op_t		*patch_op;	/* the write the patch table is laid over */
+char		*audit_filename;
+char		*unit_dir;
+unit_t		*unit;
+unit_block_t	*plan;		/* blocks of a write planned from the unit record */
+unsigned int	plan_count;
+char		opt_print	= 0;
+int		opt_count	= 0;
+char		*opt_assign[16];
+
+/* functions */
+int  parse_options(int argc, char *argv[]);
+int  parse_script(const char *name);
+int  parse_range(const char *arg, uint32_t *start, uint32_t *len);
+void show_help(char *name);
+
+#ifdef LANTRONIX_CPM
+void cpm_reset()
+{
+	system("cpm -N STM8_RESET -V 1");
+	system("cpm -N STM8_RESET -V 0");
+	usleep(50000);
+}
+#endif
+
+int isMemZero(const uint8_t *data, int len)
+{
+	if(len <= 0) return 0;
+
+	do {
+		len--;
+		if(data[len]) return 0;
+	} while(len);
+	
+	return 1;
+}
+
+/* get the last address of the memory area containing addr, 0 if there is none */
+uint32_t area_end(const stm8_dev_t *dev, uint32_t addr)
+{
+	if (addr >= dev->fl_start  && addr <= dev->fl_end ) return dev->fl_end;
+	if (addr >= dev->mem_start && addr <= dev->mem_end) return dev->mem_end;
+	if (addr >= dev->opt_start && addr <= dev->opt_end) return dev->opt_end;
+	if (addr >= dev->ram_start && addr <= dev->ram_end) return dev->ram_end;
+	return 0;
+}
+
+/* the number of bytes of [first, last] in the area [a_first, a_last], flag is set if there are any */
+uint32_t area_part(uint32_t first, uint32_t last, uint32_t a_first, uint32_t a_last, char *flag)
+{
+	if (first < a_first) first = a_first;
+	if (last  > a_last ) last  = a_last;
+	if (first > last) return 0;
+
+	*flag = 1;
+	return last - first + 1;
+}
+
+/* resolve the range of an operation into [start, end), defaults to the whole flash */
+int get_range(const stm8_dev_t *dev, const op_t *op, uint32_t *start, uint32_t *end)
+{
+	uint32_t last;
+
+	if (!op->range_flag) {
+		*start = dev->fl_start;
+		*end   = dev->fl_end + 1;
+		return 0;
+	}
+
+	last = area_end(dev, op->range_start);
+	if (!last) {
+		fprintf(fp_stderr, "Range start 0x%08x is outside of the device memory\n", op->range_start);
+		return 1;
+	}
+
+	*start = op->range_start;
+	*end   = op->range_len ? op->range_start + op->range_len : last + 1;
+	if (*end - 1 > last) {
+		fprintf(fp_stderr, "Range 0x%08x:0x%x crosses the end of its memory area (0x%08x)\n", op->range_start, op->range_len, last);
+		return 1;
+	}
+	return 0;
+}
+
+/* erase the flash sectors touched by [start, end) */
+char erase_range(const stm8_t *stm, uint32_t start, uint32_t end)
+{
+	const stm8_dev_t *dev = stm->dev;
+	uint32_t	sector_size = dev->fl_pps * dev->fl_ps;
+	uint8_t		sectors[255];
+	unsigned int	count = 0;
+	uint32_t	s;
+
+	if (end <= dev->fl_start || start > dev->fl_end) return 1;
+	if (start < dev->fl_start) start = dev->fl_start;
+	if (end > dev->fl_end + 1) end = dev->fl_end + 1;
+
+	for (s = (start - dev->fl_start) / sector_size; s <= (end - 1 - dev->fl_start) / sector_size; s++) {
+		sectors[count++] = s;
+		if (count == sizeof(sectors)) {
+			if (!stm8_erase_sectors(stm, sectors, count)) return 0;
+			count = 0;
+		}
+	}
+
+	return count ? stm8_erase_sectors(stm, sectors, count) : 1;
+}
+
+/* pick the output format from the file extension, raw binary unless it names Intel HEX or S-records */
+parser_t *output_parser(const char *name)
+{
+	const char *ext = strrchr(name, '.');
+
+	if (force_binary || !ext)
+		return &PARSER_BINARY;
+	if (strcasecmp(ext, ".hex") == 0 || strcasecmp(ext, ".ihx") == 0)
+		return &PARSER_HEX;
+	if (strcasecmp(ext, ".s19") == 0 || strcasecmp(ext, ".s28") == 0 || strcasecmp(ext, ".s37") == 0 ||
+	    strcasecmp(ext, ".srec") == 0 || strcasecmp(ext, ".mot") == 0)
+		return &PARSER_SREC;
+	return &PARSER_BINARY;
+}
+
+/* the formats an image is tried as, in order, a raw binary takes anything */
+parser_t *image_parsers[] = {
+	&PARSER_FRAMED,		/* recognised by its header */
+	&PARSER_HEX,
+	&PARSER_SREC,
+	&PARSER_ELF,
+	&PARSER_BINARY
+};
+
+/* open an image for reading, trying the container, Intel HEX, S-records and ELF first unless -f was given */
+int open_image(const char *name, parser_t **pp, void **pst)
+{
+	const int	count	= sizeof(image_parsers) / sizeof(image_parsers[0]);
+	parser_t	*p	= NULL;
+	void		*st	= NULL;
+	parser_err_t	perr	= PARSER_ERR_INVALID_FILE;
+	char		path[CACHE_PATH_MAX];
+	int		i;
+
+	/* an unchanged text image was parsed before, map what it came to */
+	path[0] = 0;
+	if (cache_dir && !force_binary) {
+		if (cache_path(cache_dir, name, path, sizeof(path)) != 0)
+			path[0] = 0;
+		else if (cache_lookup(path, pp, pst) == 0)
+			return 0;
+	}
+
+	for (i = force_binary ? count - 1 : 0; perr == PARSER_ERR_INVALID_FILE && i < count; ++i) {
+		p  = image_parsers[i];
+		st = p->init();
+		if (!st) {
+			fprintf(fp_stderr, "%s Parser failed to initialize\n", p->name);
+			return 1;
+		}
+		perr = p->open(st, name, 0);
+		if (perr != PARSER_ERR_OK)
+			p->close(st);
+	}
+
+	/* if still have an error, fail */
+	if (perr != PARSER_ERR_OK) {
+		fprintf(fp_stderr, "%s ERROR: %s\n", p->name, parser_errstr(perr));
+		if (perr == PARSER_ERR_SYSTEM) perror(name);
+		return 1;
+	}
+
+	/* binaries and ELF files are mapped as they are, only text images are worth keeping */
+	if (cache_dir && path[0] && (p == &PARSER_HEX || p == &PARSER_SREC) &&
+	    cache_store(path, p, st) == 0 && cache_lookup(path, pp, pst) == 0) {
+		p->close(st);
+		return 0;
+	}
+
+	*pp  = p;
+	*pst = st;
+	return 0;
+}
+
+/*
+	write data to the data EEPROM, comparing against the current contents
+	first so that only the changed part of each block is sent, batched into
+	one write per block
+*/
+int write_eeprom(const stm8_t *stm, uint32_t start, const uint8_t *data, unsigned int len)
+{
+	const stm8_dev_t *dev = stm->dev;
+	uint8_t		current[len];
+	uint8_t		compare[dev->fl_ps];
+	unsigned int	i, n, first, last, block_end;
+	unsigned int	written = 0;
+	int		failed = 0;
+
+	/* data EEPROM is programmed in blocks of the flash block size */
+	for (i = 0; i < len; i += n) {
+		n = len - i > 256 ? 256 : len - i;
+		if (!stm8_read_memory(stm, start + i, &current[i], n)) {
+			fprintf(fp_stderr, "Failed to read EEPROM at address 0x%08x\n", start + i);
+			return 1;
+		}
+	}
+
+	fprintf(fp_stdout, "\x1B[s");
+	fflush(fp_stdout);
+	for (i = 0; i < len; i = block_end) {
+		block_end = ((start + i) / dev->fl_ps + 1) * dev->fl_ps - start;
+		if (block_end > len) block_end = len;
+
+		for (first = i; first < block_end && data[first] == current[first]; ++first);
+		if (first == block_end) continue;
+		for (last = block_end - 1; data[last] == current[last]; --last);
+		n = last - first + 1;
+
+		again:
+		if (!stm8_write_memory(stm, start + first, &data[first], n)) {
+			fprintf(fp_stderr, "Failed to write EEPROM at address 0x%08x\n", start + first);
+			return 1;
+		}
+
+		if (verify) {
+			if (!stm8_read_memory(stm, start + first, compare, n)) {
+				fprintf(fp_stderr, "Failed to read EEPROM at address 0x%08x\n", start + first);
+				return 1;
+			}
+
+			if (memcmp(compare, &data[first], n) != 0) {
+				if (failed == retry) {
+					fprintf(fp_stderr, "Failed to verify EEPROM at address 0x%08x\n", start + first);
+					return 1;
+				}
+				++failed;
+				goto again;
+			}
+			failed = 0;
+		}
+
+		written += n;
+		fprintf(fp_stdout,
+			"\x1B[uWrote %sEEPROM address 0x%08x (%.2f%%) ",
+			verify ? "and verified " : "",
+			start + block_end,
+			(100.0f / len) * block_end
+		);
+		fflush(fp_stdout);
+	}
+
+	fprintf(fp_stdout, "Done, %u of %u bytes changed.\n", written, len);
+	return 0;
+}
+
+#ifndef __WIN32__
+/* a mapped dump is made safe on disk and its progress noted this often */
+#define READ_CHECKPOINT	4096
+
+/*
+	read [start, end) straight into a pre-sized mapping of the output file.
+	Progress is kept in "<file>.resume" with the unique ID of the device
+	until the dump is complete, running the same read again after an
+	interruption carries on where it stopped
+*/
+int read_mapped(op_t *op, uint32_t start, uint32_t end)
+{
+	char		resume[4096];
+	char		uid[2 * UNIT_ID_LEN + 1], was[sizeof(uid)];
+	uint8_t		id[UNIT_ID_LEN];
+	uint8_t		*map;
+	uint32_t	addr = start, mark;
+	unsigned int	len, from, to, next, i;
+	stm8_digest_t	digest;
+	struct stat	sb;
+	FILE		*fp;
+	int		fd, ret = 1;
+
+	if (!stm8_read_memory(stm, stm->dev->uid, id, sizeof(id))) {
+		fprintf(fp_stderr, "Failed to read the unique ID\n");
+		return 1;
+	}
+	for (i = 0; i < sizeof(id); ++i)
+		sprintf(&uid[2 * i], "%02x", id[i]);
+
+	snprintf(resume, sizeof(resume), "%s.resume", op->filename);
+	if ((fd = open(op->filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+		perror(op->filename);
+		return 1;
+	}
+
+	/* only a dump of the same range and device with the file still in one piece can be continued */
+	if ((fp = fopen(resume, "r"))) {
+		if (fscanf(fp, "%x %x %x %24s", &from, &to, &next, was) == 4 && from == start && to == end &&
+		    next >= start && next <= end && strcmp(was, uid) == 0 &&
+		    fstat(fd, &sb) == 0 && sb.st_size == end - start)
+			addr = next;
+		fclose(fp);
+	}
+
+	if (ftruncate(fd, addr == start ? 0 : end - start) != 0 || ftruncate(fd, end - start) != 0) {
+		perror(op->filename);
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, end - start, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(op->filename);
+		return 1;
+	}
+
+	/* the device may have been written since, what was read must still be there */
+	if (addr != start) {
+		digest.address	= start;
+		digest.len	= addr - start;
+		if (!stm8_restartable(stm)) {
+			fprintf(fp_stderr, "Can not check the part read before on the device, starting over\n");
+			addr = start;
+		} else if (!stm8_digest(stm, &digest, 1)) {
+			fprintf(fp_stderr, "Failed to compute the flash digests\n");
+			goto out;
+		} else if (digest.crc != crc16(0xFFFF, map, addr - start)) {
+			fprintf(fp_stderr, "The device changed since the read stopped, starting over\n");
+			addr = start;
+		} else
+			fprintf(fp_stderr, "Resuming at address 0x%08x\n", addr);
+	}
+
+	fprintf(fp_stdout, "\x1B[s");
+	fflush(fp_stdout);
+	for (mark = addr; addr < end; ) {
+		len = end - addr > 256 ? 256 : end - addr;
+		if (!stm8_read_memory(stm, addr, map + (addr - start), len)) {
+			fprintf(fp_stderr, "Failed to read memory at address 0x%08x, target write-protected?\n", addr);
+			goto out;
+		}
+		addr += len;
+
+		if (addr - mark >= READ_CHECKPOINT && addr < end) {
+			if (msync(map, end - start, MS_SYNC) != 0 || !(fp = fopen(resume, "w"))) {
+				perror(resume);
+				goto out;
+			}
+			fprintf(fp, "0x%08x 0x%08x 0x%08x %s\n", start, end, addr, uid);
+			if (fclose(fp) != 0) {
+				perror(resume);
+				goto out;
+			}
+			mark = addr;
+		}
+
+		fprintf(fp_stdout,
+			"\x1B[uRead address 0x%08x (%.2f%%) ",
+			addr,
+			(100.0f / (float)(end - start)) * (float)(addr - start)
+		);
+		fflush(fp_stdout);
+	}
+
+	if (msync(map, end - start, MS_SYNC) != 0) {
+		perror(op->filename);
+		goto out;
+	}
+	unlink(resume);
+	fprintf(fp_stdout,	"Done.\n");
+	ret = 0;
+
+out:
+	munmap(map, end - start);
+	return ret;
+}
+#endif
+
+/* read a memory range (or the whole data EEPROM) to a binary file */
+int op_read(op_t *op)
+{
+	uint8_t		buffer[256];
+	uint32_t	addr, start, end;
+	unsigned int	len;
+	parser_err_t	perr;
+
+	fprintf(fp_stdout,"\n");
+
+	if (op->type == OP_EE_READ) {
+		start	= stm->dev->mem_start;
+		end	= stm->dev->mem_end + 1;
+	} else if (get_range(stm->dev, op, &start, &end) != 0)
+		return 1;
+
+	op->parser = output_parser(op->filename);
+#ifndef __WIN32__
+	if (op->parser == &PARSER_BINARY && strcmp(op->filename, "-") != 0)
+		return read_mapped(op, start, end);
+#endif
+	op->p_st = op->parser->init();
+	if (!op->p_st) {
+		fprintf(fp_stderr, "%s Parser failed to initialize\n", op->parser->name);
+		return 1;
+	}
+
+	if ((perr = op->parser->open(op->p_st, op->filename, 1)) != PARSER_ERR_OK) {
+		fprintf(fp_stderr, "%s ERROR: %s\n", op->parser->name, parser_errstr(perr));
+		if (perr == PARSER_ERR_SYSTEM) perror(op->filename);
+		return 1;
+	}
+
+	addr = start;
+	fprintf(fp_stdout, "\x1B[s");
+	fflush(fp_stdout);
+	while(addr < end) {
+		uint32_t left	= end - addr;
+		len		= sizeof(buffer) > left ? left : sizeof(buffer);
+		if (!stm8_read_memory(stm, addr, buffer, len)) {
+			fprintf(fp_stderr, "Failed to read memory at address 0x%08x, target write-protected?\n", addr);
+			return 1;
+		}
+
+		/* a raw binary has to stay contiguous, formats with addresses may leave blocks out */
+		if (!skip_erased || op->parser == &PARSER_BINARY || !isMemZero(buffer, len)) {
+			if ((perr = op->parser->write(op->p_st, addr, buffer, len)) != PARSER_ERR_OK) {
+				fprintf(fp_stderr, "%s ERROR: %s\n", op->parser->name, parser_errstr(perr));
+				if (perr == PARSER_ERR_SYSTEM) perror(op->filename);
+				return 1;
+			}
+		}
+		addr += len;
+
+		fprintf(fp_stdout,
+			"\x1B[uRead address 0x%08x (%.2f%%) ",
+			addr,
+			(100.0f / (float)(end - start)) * (float)(addr - start)
+		);
+		fflush(fp_stdout);
+	}
+
+	/* closing flushes the buffered output */
+	perr = op->parser->close(op->p_st);
+	op->p_st = NULL;
+	if (perr != PARSER_ERR_OK) {
+		fprintf(fp_stderr, "%s ERROR: %s\n", op->parser->name, parser_errstr(perr));
+		if (perr == PARSER_ERR_SYSTEM) perror(op->filename);
+		return 1;
+	}
+
+	fprintf(fp_stdout,	"Done.\n");
+	return 0;
+}
+
+/*
+	write the image segments within [start, end) one flash block at a
+	time, each block is sent as a single WRITE covering the image bytes it
+	holds, nothing is sent for the gaps between segments
+*/
+int write_segments(op_t *op, uint32_t base, uint32_t start, uint32_t end, char patched)
+{
+	parser_iter_t	it;
+	parser_blocks_t	bs;
+	parser_block_t	b;
+	parser_seg_t	seg;
+	uint8_t		block[PARSER_BLOCK];
+	uint8_t		compare[PARSER_BLOCK];
+	const uint8_t	*data;
+	unsigned int	i, first, last;
+	uint32_t	blk, from, to;
+	uint32_t	total = 0, done = 0;
+	unit_block_t	*u;
+	int		failed = 0;
+
+	/* count the bytes to write for the progress */
+	parser_iter_init(&it, op->parser, op->p_st, base);
+	while (parser_next(&it, &seg) == PARSER_ERR_OK) {
+		from = seg.address > start ? seg.address : start;
+		to   = seg.address + seg.len < end ? seg.address + seg.len : end;
+		if (from < to && (!patched || patch_overlaps(patch, from, to))) total += to - from;
+	}
+
+	fprintf(fp_stdout, "\x1B[s");
+	fflush(fp_stdout);
+	parser_blocks_init(&bs, op->parser, op->p_st, base, start, end);
+	while (parser_next_block(&bs, &b) == PARSER_ERR_OK) {
+		blk   = b.address;
+		first = b.first;
+		last  = b.last;
+		data  = b.data;
+
+		/* the rest already went out as stored frames */
+		if (patched && !patch_overlaps(patch, blk, blk + PARSER_BLOCK))
+			continue;
+		done += b.bytes;
+
+		/* planned from the unit record, nothing was erased so the whole block is sent */
+		if (plan) {
+			if ((u = unit_find(plan, plan_count, blk)) && u->same)
+				continue;
+			memset(block, 0, sizeof(block));
+			memcpy(&block[first], data, last - first);
+			data  = block;
+			first = 0;
+			last  = sizeof(block);
+		}
+
+		again:
+		if (op->erase == ERASE_NONE || !isMemZero(data, last - first)) {
+			if (!stm8_write_memory(stm, blk + first, data, last - first)) {
+				fprintf(fp_stderr, "Failed to write memory at address 0x%08x\n", blk + first);
+				return 1;
+			}
+		}
+
+		if (verify && !verify_after) {
+			if (!stm8_read_memory(stm, blk + first, compare, last - first)) {
+				fprintf(fp_stderr, "Failed to read memory at address 0x%08x\n", blk + first);
+				return 1;
+			}
+
+			for (i = first; i < last; ++i)
+				if (data[i - first] != compare[i - first]) {
+					if (failed == retry) {
+						fprintf(fp_stderr, "Failed to verify at address 0x%08x, expected 0x%02x and found 0x%02x\n",
+							blk + i, data[i - first], compare[i - first]);
+						return 1;
+					}
+					++failed;
+					goto again;
+				}
+
+			failed = 0;
+		}
+
+		fprintf(fp_stdout,
+			"\x1B[uWrote %saddress 0x%08x (%.2f%%) ",
+			verify && !verify_after ? "and verified " : "",
+			blk + last,
+			(100.0f / total) * done
+		);
+		fflush(fp_stdout);
+	}
+
+	fprintf(fp_stdout,	"Done.\n");
+	return 0;
+}
+
+/*
+	send the prebuilt frames of a container for the blocks within
+	[start, end), a block cut by the range is sent as a plain WRITE.
+	When patched the blocks with per unit data are left to write_segments
+*/
+int write_framed(op_t *op, void *storage, uint32_t start, uint32_t end, char patched)
+{
+	framed_block_t	b;
+	uint8_t		block[FRAMED_BLOCK];
+	uint8_t		compare[FRAMED_BLOCK];
+	const uint8_t	*data;
+	unsigned int	i, r, count = framed_count(storage);
+	uint32_t	from, to, blk;
+	uint32_t	total = 0, done = 0;
+	unit_block_t	*u;
+	int		failed = 0;
+	char		ok;
+
+	for (i = 0; i < count; ++i) {
+		framed_get(storage, i, &b);
+		from = b.address > start ? b.address : start;
+		to   = b.address + b.len < end ? b.address + b.len : end;
+		blk  = b.address - b.address % FRAMED_BLOCK;
+		if (from < to && !(patched && patch_overlaps(patch, blk, blk + FRAMED_BLOCK))) total += to - from;
+	}
+
+	fprintf(fp_stdout, "\x1B[s");
+	fflush(fp_stdout);
+	for (i = 0; i < count; ++i) {
+		framed_get(storage, i, &b);
+		from = b.address > start ? b.address : start;
+		to   = b.address + b.len < end ? b.address + b.len : end;
+		if (from >= to) continue;
+
+		/* a block with per unit data is framed again by write_segments */
+		blk = b.address - b.address % FRAMED_BLOCK;
+		if (patched && patch_overlaps(patch, blk, blk + FRAMED_BLOCK)) continue;
+		data = b.data_frame + 1 + (from - b.address);
+
+		if (plan) {
+			if ((u = unit_find(plan, plan_count, blk)) && u->same) {
+				done += to - from;
+				continue;
+			}
+			if (b.len != FRAMED_BLOCK) {
+				memset(block, 0, sizeof(block));
+				memcpy(&block[b.address - blk], data, b.len);
+				data = block;
+				from = blk;
+				to   = blk + FRAMED_BLOCK;
+			}
+		}
+
+		again:
+		if (op->erase == ERASE_NONE || !(b.flags & FRAMED_ZERO)) {
+			if (from == b.address && to == b.address + b.len)
+				ok = stm8_write_framed(stm, b.addr_frame, b.data_frame, b.len);
+			else
+				ok = stm8_write_memory(stm, from, data, to - from);
+			if (!ok) {
+				fprintf(fp_stderr, "Failed to write memory at address 0x%08x\n", from);
+				return 1;
+			}
+		}
+
+		if (verify && !verify_after) {
+			if (!stm8_read_memory(stm, from, compare, to - from)) {
+				fprintf(fp_stderr, "Failed to read memory at address 0x%08x\n", from);
+				return 1;
+			}
+
+			for (r = 0; r < to - from; ++r)
+				if (data[r] != compare[r]) {
+					if (failed == retry) {
+						fprintf(fp_stderr, "Failed to verify at address 0x%08x, expected 0x%02x and found 0x%02x\n",
+							from + r, data[r], compare[r]);
+						return 1;
+					}
+					++failed;
+					goto again;
+				}
+
+			failed = 0;
+		}
+
+		done += to - from;
+		fprintf(fp_stdout,
+			"\x1B[uWrote %saddress 0x%08x (%.2f%%) ",
+			verify && !verify_after ? "and verified " : "",
+			to,
+			(100.0f / total) * done
+		);
+		fflush(fp_stdout);
+	}
+
+	fprintf(fp_stdout,	"Done.\n");
+	return 0;
+}
+
+/* list the flash sectors a write erases, those holding image data within [start, end) for a range */
+unsigned int erase_list(op_t *op, uint32_t start, uint32_t end, uint8_t sectors[256])
+{
+	const stm8_dev_t *dev = stm->dev;
+	uint32_t	sector_size = dev->fl_pps * dev->fl_ps;
+	unsigned int	count = 0;
+	uint32_t	from, to, s, next = 0;
+	parser_iter_t	it;
+	parser_seg_t	seg;
+
+	if (op->erase == ERASE_ALL) {
+		next = npages == 0xFF ? (dev->fl_end + 1 - dev->fl_start) / sector_size : npages + 1u;
+		for (s = 0; s < next && s < 256; ++s)
+			sectors[count++] = s;
+		return count;
+	}
+	if (op->erase != ERASE_RANGE)
+		return 0;
+
+	if (start < dev->fl_start) start = dev->fl_start;
+	if (end > dev->fl_end + 1) end = dev->fl_end + 1;
+
+	parser_iter_init(&it, op->parser, op->p_st, start);
+	while (parser_next(&it, &seg) == PARSER_ERR_OK) {
+		from = seg.address > start ? seg.address : start;
+		to   = seg.address + seg.len < end ? seg.address + seg.len : end;
+		if (from >= to) continue;
+
+		/* segments come sorted, so a sector shared with the last one is already listed */
+		for (s = (from - dev->fl_start) / sector_size; s <= (to - 1 - dev->fl_start) / sector_size && s < 256; s++) {
+			if (s < next) continue;
+			sectors[count++] = s;
+			next = s + 1;
+		}
+	}
+
+	return count;
+}
+
+/* write the option bytes an image holds, complements are taken from the image */
+int write_image_options(op_t *op, uint32_t base, uint32_t start, uint32_t end)
+{
+	optbytes_t	opt;
+	parser_iter_t	it;
+	parser_seg_t	seg;
+	uint32_t	from, to;
+
+	if (!optbytes_read(stm, &opt)) {
+		fprintf(fp_stderr, "Failed to read option bytes, target read-out protected?\n");
+		return 1;
+	}
+
+	if (start < opt.start) start = opt.start;
+	if (end > opt.start + opt.len) end = opt.start + opt.len;
+
+	parser_iter_init(&it, op->parser, op->p_st, base);
+	while (parser_next(&it, &seg) == PARSER_ERR_OK) {
+		from = seg.address > start ? seg.address : start;
+		to   = seg.address + seg.len < end ? seg.address + seg.len : end;
+		if (from < to)
+			memcpy(&opt.wanted[from - opt.start], &seg.data[from - seg.address], to - from);
+	}
+
+	if (!optbytes_changed(&opt)) {
+		fprintf(fp_stdout, "Option bytes already up to date.\n");
+		return 0;
+	}
+
+	fprintf(fp_stdout, "Writing option bytes... ");
+	fflush(fp_stdout);
+	if (!optbytes_write(stm, &opt, verify))
+		return 1;
+	fprintf(fp_stdout, "Done.\n");
+	optbytes_check(&opt, fp_stderr);
+	return 0;
+}
+
+/* write the data EEPROM parts of an image within [start, end), only the bytes that differ are sent */
+int write_image_eeprom(op_t *op, uint32_t base, uint32_t start, uint32_t end)
+{
+	const stm8_dev_t *dev = stm->dev;
+	parser_iter_t	it;
+	parser_seg_t	seg;
+	uint32_t	from, to;
+
+	if (start < dev->mem_start) start = dev->mem_start;
+	if (end > dev->mem_end + 1) end = dev->mem_end + 1;
+
+	parser_iter_init(&it, op->parser, op->p_st, base);
+	while (parser_next(&it, &seg) == PARSER_ERR_OK) {
+		from = seg.address > start ? seg.address : start;
+		to   = seg.address + seg.len < end ? seg.address + seg.len : end;
+		if (from < to && write_eeprom(stm, from, &seg.data[from - seg.address], to - from) != 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* the CRC of [address, address + len) as a write leaves it after an erase, the image with zero around it */
+uint16_t erased_crc(op_t *op, uint32_t base, uint32_t address, uint32_t len)
+{
+	static const uint8_t zero[PARSER_BLOCK];
+	parser_blocks_t	bs;
+	parser_block_t	b;
+	uint16_t	crc = 0xFFFF;
+	uint32_t	pos = address, n, m;
+
+	parser_blocks_init(&bs, op->parser, op->p_st, base, address, address + len);
+	for (;;) {
+		n = parser_next_block(&bs, &b) == PARSER_ERR_OK ? b.address + b.first : address + len;
+		for (; pos < n; pos += m) {
+			m   = n - pos > sizeof(zero) ? sizeof(zero) : n - pos;
+			crc = crc16(crc, zero, m);
+		}
+		if (n == address + len)
+			return crc;
+		crc = crc16(crc, b.data, b.last - b.first);
+		pos = b.address + b.last;
+	}
+}
+
+/*
+	check on the target whether the flash already holds the image within
+	[start, end), comparing the CRC of each run of image data with the
+	image. The sectors listed are checked for being erased in the same
+	run, blank gets the result. A write that erases it all leaves nothing
+	but the image, so then the bytes around the image have to be zero as
+	well, each sector is compared as a whole. Returns 1 if the flash is
+	up to date, 0 if not or it can not tell and -1 on errors
+*/
+int flash_up_to_date(op_t *op, uint32_t start, uint32_t end, const uint8_t sectors[], unsigned int count, uint8_t blank[])
+{
+	const stm8_dev_t *dev = stm->dev;
+	uint32_t	sector_size = dev->fl_pps * dev->fl_ps;
+	stm8_digest_t	digest[512];
+	uint16_t	crc[256];
+	unsigned int	runs = 0, i;
+	char		compare = 1, same;
+	uint32_t	from, to;
+	parser_iter_t	it;
+	parser_seg_t	seg;
+
+	if (start < dev->fl_start) start = dev->fl_start;
+	if (end > dev->fl_end + 1) end = dev->fl_end + 1;
+
+	parser_iter_init(&it, op->parser, op->p_st, start);
+	while (compare && parser_next(&it, &seg) == PARSER_ERR_OK) {
+		from = seg.address > start ? seg.address : start;
+		to   = seg.address + seg.len < end ? seg.address + seg.len : end;
+		if (from >= to) continue;
+
+		/* runs of touching segments make one region, too many and it is not worth it */
+		if (!runs || digest[runs - 1].address + digest[runs - 1].len != from) {
+			if (runs == sizeof(crc) / sizeof(crc[0])) {
+				compare = 0;
+				runs	= 0;
+				break;
+			}
+			digest[runs].address	= from;
+			digest[runs].len	= 0;
+			crc[runs++]		= 0xFFFF;
+		}
+		crc[runs - 1] = crc16(crc[runs - 1], &seg.data[from - seg.address], to - from);
+		digest[runs - 1].len += to - from;
+	}
+
+	for (i = 0; i < count; ++i) {
+		digest[runs + i].address = dev->fl_start + sectors[i] * sector_size;
+		digest[runs + i].len	 = sector_size;
+	}
+
+	if ((!runs && !count) || !stm8_restartable(stm))
+		return 0;
+
+	fprintf(fp_stdout, "Checking the flash... ");
+	fflush(fp_stdout);
+	if (!stm8_digest(stm, digest, runs + count)) {
+		fprintf(fp_stderr, "Failed to compute the flash digests\n");
+		return -1;
+	}
+
+	for (i = 0; i < count; ++i)
+		blank[i] = digest[runs + i].blank;
+
+	for (i = 0; i < runs && digest[i].crc == crc[i]; ++i);
+	same = runs && i == runs;
+	for (i = 0; same && op->erase == ERASE_ALL && i < count; ++i)
+		same = digest[runs + i].crc == erased_crc(op, start, digest[runs + i].address, sector_size);
+
+	if (same) {
+		fprintf(fp_stdout, "already up to date.\n");
+		return 1;
+	}
+	fprintf(fp_stdout, "%s.\n", runs ? "differs" : "Done");
+	return 0;
+}
+
+/*
+	verify the flash part of an image within [start, end) once it is all
+	written (-V). Runs of adjacent blocks are read back 256 bytes at a
+	time, blocks of zeros are left out when an erase took care of them.
+	Mismatches are reported as ranges and only the blocks holding them
+	are written again
+*/
+int verify_image(op_t *op, uint32_t start, uint32_t end)
+{
+	const stm8_dev_t *dev = stm->dev;
+	parser_iter_t	it;
+	parser_seg_t	seg;
+	uint8_t		*want, *first, *last, *pending;
+	uint8_t		data[256];
+	uint32_t	base, from, to, run, len, i, n, blocks, bad_start = 0, bad_end = 0;
+	unsigned int	b, bad = 0, tries = 0;
+	int		ret = 1;
+
+	if (start < dev->fl_start) start = dev->fl_start;
+	if (end > dev->fl_end + 1) end = dev->fl_end + 1;
+	if (start >= end) return 0;
+
+	base   = start - start % 128;
+	blocks = (end - base + 127) / 128;
+	want   = calloc(blocks, 128 + 3);
+	if (!want) {
+		fprintf(fp_stderr, "Out of memory\n");
+		return 1;
+	}
+	first   = want + blocks * 128;
+	last    = first + blocks;
+	pending = last + blocks;
+
+	/* the expected contents, the bytes of each block from its first to its last data byte */
+	memset(first, 128, blocks);
+	parser_iter_init(&it, op->parser, op->p_st, start);
+	while (parser_next(&it, &seg) == PARSER_ERR_OK) {
+		from = seg.address > start ? seg.address : start;
+		to   = seg.address + seg.len < end ? seg.address + seg.len : end;
+		if (from >= to) continue;
+
+		memcpy(&want[from - base], &seg.data[from - seg.address], to - from);
+		for (b = (from - base) / 128; b <= (to - 1 - base) / 128; ++b) {
+			i = from > base + b * 128       ? from - base - b * 128 : 0;
+			n = to   < base + (b + 1) * 128 ? to   - base - b * 128 : 128;
+			if (i < first[b]) first[b] = i;
+			if (n > last[b] ) last[b]  = n;
+		}
+	}
+	for (b = 0; b < blocks; ++b) {
+		/* planned from a unit record the blocks went out whole, zero around the data */
+		if (plan && first[b] < last[b]) {
+			first[b] = 0;
+			last[b]  = 128;
+		}
+		pending[b] = first[b] < last[b] &&
+			(op->erase == ERASE_NONE || !isMemZero(&want[b * 128 + first[b]], last[b] - first[b]));
+	}
+
+	fprintf(fp_stdout, "Verifying... ");
+	fflush(fp_stdout);
+	for (;;) {
+		bad = 0;
+		for (b = 0; b < blocks; b = run) {
+			if (!pending[b]) {
+				run = b + 1;
+				continue;
+			}
+
+			/* a run goes on while the data of one block meets that of the next */
+			from = base + b * 128 + first[b];
+			for (run = b + 1; run < blocks && pending[run] && last[run - 1] == 128 && first[run] == 0; ++run);
+			to   = base + (run - 1) * 128 + last[run - 1];
+			for (i = b; i < run; ++i)
+				pending[i] = 0;
+
+			for (; from < to; from += len) {
+				len = to - from > sizeof(data) ? sizeof(data) : to - from;
+				if (!stm8_read_memory(stm, from, data, len)) {
+					fprintf(fp_stderr, "Failed to read memory at address 0x%08x\n", from);
+					goto out;
+				}
+				if (!memcmp(data, &want[from - base], len))
+					continue;
+
+				for (i = 0; i < len; ++i) {
+					if (data[i] == want[from - base + i]) continue;
+					if (from + i != bad_end) {
+						if (bad_end)
+							fprintf(fp_stdout, "\nMismatch at 0x%08x-0x%08x", bad_start, bad_end - 1);
+						bad_start = from + i;
+					}
+					bad_end = from + i + 1;
+					n = (from + i - base) / 128;
+					bad += !pending[n];
+					pending[n] = 1;
+				}
+			}
+		}
+		if (bad_end)
+			fprintf(fp_stdout, "\nMismatch at 0x%08x-0x%08x\n", bad_start, bad_end - 1);
+		bad_end = 0;
+
+		if (!bad)
+			break;
+		if (tries++ == retry) {
+			fprintf(fp_stderr, "Failed to verify %u blocks\n", bad);
+			goto out;
+		}
+
+		fprintf(fp_stdout, "Writing %u blocks again... ", bad);
+		fflush(fp_stdout);
+		for (b = 0; b < blocks; ++b) {
+			if (!pending[b]) continue;
+			from = base + b * 128 + first[b];
+			if (!stm8_write_memory(stm, from, &want[from - base], last[b] - first[b])) {
+				fprintf(fp_stderr, "Failed to write memory at address 0x%08x\n", from);
+				goto out;
+			}
+		}
+	}
+	fprintf(fp_stdout, "Done.\n");
+	ret = 0;
+
+out:
+	free(want);
+	return ret;
+}
+
+/* send the flash blocks of an image within [start, end), the flash is erased already */
+int write_image_blocks(op_t *op, uint32_t start, uint32_t end)
+{
+	int ret;
+
+	if (op->parser == &PARSER_FRAMED)
+		ret = write_framed(op, op->p_st, start, end, 0);
+
+	/* stored frames for the untouched blocks, the patched ones are framed here */
+	else if (op->parser == &PARSER_PATCH && patch_parser(op->p_st) == &PARSER_FRAMED)
+		ret = write_framed(op, patch_storage(op->p_st), start, end, 1) != 0 ||
+		      write_segments(op, start, start, end, 1) != 0;
+
+	else
+		ret = write_segments(op, start, start, end, 0);
+
+	return ret || (verify_after && verify_image(op, start, end) != 0);
+}
+
+/* erase and write the flash part of an image, kept is set when the flash held it already */
+int write_image_flash(op_t *op, uint32_t start, uint32_t end, char *kept)
+{
+	uint8_t		sectors[256], blank[256];
+	unsigned int	count, i, n;
+
+	count = erase_list(op, start, end, sectors);
+	memset(blank, 0, sizeof(blank));
+	*kept = 0;
+
+	/* units coming back with the right firmware are left alone */
+	switch (flash_up_to_date(op, start, end, sectors, count, blank)) {
+		case -1:
+			return 1;
+		case 1:
+			*kept = 1;
+			return 0;
+	}
+
+	/* fresh chips are blank already, only what is not gets erased */
+	for (i = n = 0; i < count; ++i)
+		if (!blank[i])
+			sectors[n++] = sectors[i];
+	if (n < count)
+		fprintf(fp_stdout, "%u of %u sectors are blank already\n", count - n, count);
+
+	if (op->erase == ERASE_ALL && n == count) {
+		if (!stm8_erase_memory(stm, npages)) {
+			fprintf(fp_stderr, "Failed to erase flash\n");
+			return 1;
+		}
+	} else
+		for (i = 0; i < n; i += 255)
+			if (!stm8_erase_sectors(stm, &sectors[i], n - i > 255 ? 255 : n - i)) {
+				fprintf(fp_stderr, "Failed to erase memory range 0x%08x-0x%08x\n", start, end - 1);
+				return 1;
+			}
+
+	return write_image_blocks(op, start, end);
+}
+
+/*
+	list the flash blocks of an image within [start, end) with the
+	checksum of what they hold after a full write
+*/
+int image_blocks(op_t *op, uint32_t start, uint32_t end, unit_block_t **blocks, unsigned int *count)
+{
+	const stm8_dev_t *dev = stm->dev;
+	parser_blocks_t	bs;
+	parser_block_t	b;
+	uint8_t		block[UNIT_BLOCK];
+	unsigned int	alloc = 0;
+	unit_block_t	*p;
+
+	if (start < dev->fl_start) start = dev->fl_start;
+	if (end > dev->fl_end + 1) end = dev->fl_end + 1;
+
+	*blocks = NULL;
+	*count  = 0;
+	parser_blocks_init(&bs, op->parser, op->p_st, start, start, end);
+	while (parser_next_block(&bs, &b) == PARSER_ERR_OK) {
+		memset(block, 0, sizeof(block));
+		memcpy(&block[b.first], b.data, b.last - b.first);
+
+		if (*count == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			if (!(p = realloc(*blocks, alloc * sizeof(*p)))) {
+				fprintf(fp_stderr, "Out of memory\n");
+				free(*blocks);
+				return 1;
+			}
+			*blocks = p;
+		}
+		(*blocks)[*count].address = b.address;
+		(*blocks)[*count].crc	  = crc16(0xFFFF, block, sizeof(block));
+		(*blocks)[*count].same	  = 0;
+		++*count;
+	}
+
+	return 0;
+}
+
+/* check the blocks the record says are in place on the target, those that are not get written */
+int confirm_blocks(unit_block_t *blocks, unsigned int count)
+{
+	stm8_digest_t	*digest;
+	unsigned int	i, n = 0;
+
+	if (!stm8_restartable(stm)) {
+		fprintf(fp_stdout, "Can not check the unit record on the device, writing every block\n");
+		for (i = 0; i < count; ++i)
+			blocks[i].same = 0;
+		return 0;
+	}
+
+	if (!(digest = malloc((count ? count : 1) * sizeof(*digest)))) {
+		fprintf(fp_stderr, "Out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < count; ++i)
+		if (blocks[i].same) {
+			digest[n].address = blocks[i].address;
+			digest[n].len	  = UNIT_BLOCK;
+			++n;
+		}
+
+	fprintf(fp_stdout, "Checking %u blocks of the unit record... ", n);
+	fflush(fp_stdout);
+	if (n && !stm8_digest(stm, digest, n)) {
+		fprintf(fp_stderr, "Failed to compute the flash digests\n");
+		free(digest);
+		return 1;
+	}
+
+	for (i = n = 0; i < count; ++i)
+		if (blocks[i].same && digest[n++].crc != blocks[i].crc)
+			blocks[i].same = 0;
+	fprintf(fp_stdout, "Done.\n");
+	free(digest);
+	return 0;
+}
+
+/* write a block of zeros over one the image no longer has, read back when verifying */
+int clear_block(uint32_t address)
+{
+	static const uint8_t zero[UNIT_BLOCK];
+	uint8_t		compare[UNIT_BLOCK];
+	int		tries;
+
+	for (tries = 0; ; ++tries) {
+		if (!stm8_write_memory(stm, address, zero, sizeof(zero))) {
+			fprintf(fp_stderr, "Failed to write memory at address 0x%08x\n", address);
+			return 1;
+		}
+		if (!verify)
+			return 0;
+
+		if (!stm8_read_memory(stm, address, compare, sizeof(compare))) {
+			fprintf(fp_stderr, "Failed to read memory at address 0x%08x\n", address);
+			return 1;
+		}
+		if (!memcmp(compare, zero, sizeof(zero)))
+			return 0;
+		if (tries == retry) {
+			fprintf(fp_stderr, "Failed to verify the cleared block at address 0x%08x\n", address);
+			return 1;
+		}
+	}
+}
+
+/*
+	a full write to a device with a unit record (-U): only the blocks that
+	differ from the record are written, without erasing, and blocks the
+	image no longer has are cleared. When verifying, the blocks taken from
+	the record are checked on the device first
+*/
+int write_image_unit(op_t *op, uint32_t start, uint32_t end)
+{
+	static const uint8_t zero[UNIT_BLOCK];
+	unit_block_t	*blocks, *b;
+	unsigned int	count, i, changed = 0, cleared = 0;
+	op_erase_t	erase = op->erase;
+	uint16_t	blank = crc16(0xFFFF, zero, sizeof(zero));
+	int		ret = 0;
+	char		kept;
+
+	if (image_blocks(op, start, end, &blocks, &count) != 0)
+		return 1;
+
+	/*
+		nothing known about the device yet, write it all and keep what
+		went in. A flash found up to date was not written, it gets its
+		record with the first write
+	*/
+	if (!unit->hash) {
+		if (write_image_flash(op, start, end, &kept) != 0 || kept) {
+			free(blocks);
+			return kept ? 0 : 1;
+		}
+		return unit_save(unit, blocks, count);
+	}
+
+	for (i = 0; i < count; ++i) {
+		b = unit_find(unit->block, unit->count, blocks[i].address);
+		blocks[i].same = b && b->crc == blocks[i].crc;
+	}
+	if (verify && confirm_blocks(blocks, count) != 0) {
+		free(blocks);
+		return 1;
+	}
+
+	for (i = 0; i < count; ++i)
+		changed += !blocks[i].same;
+	for (i = 0; i < unit->count; ++i)
+		if (!unit_find(blocks, count, unit->block[i].address) && unit->block[i].crc != blank)
+			++cleared;
+
+	if (!changed && !cleared) {
+		fprintf(fp_stdout, "Flash already up to date (unit %s).\n", unit->id);
+		free(blocks);
+		return 0;
+	}
+
+	fprintf(fp_stdout, "Unit %s: writing %u of %u blocks, clearing %u\n", unit->id, changed, count, cleared);
+	if (unit_forget(unit) != 0) {
+		free(blocks);
+		return 1;
+	}
+
+	plan	   = blocks;
+	plan_count = count;
+	op->erase  = ERASE_NONE;
+	if (changed)
+		ret = write_image_blocks(op, start, end);
+	for (i = 0; ret == 0 && i < unit->count; ++i) {
+		if (unit_find(blocks, count, unit->block[i].address) || unit->block[i].crc == blank)
+			continue;
+		ret = clear_block(unit->block[i].address);
+	}
+	op->erase  = erase;
+	plan	   = NULL;
+	plan_count = 0;
+
+	if (ret != 0) {
+		free(blocks);
+		return 1;
+	}
+	return unit_save(unit, blocks, count);
+}
+
+/*
+	erase, write and optionally verify an image, each segment goes to the
+	memory area it is in and gaps are left alone. A range limits the write
+	to the data inside it, without one flash, EEPROM and option byte data
+	are all written
+*/
+int write_image(op_t *op)
+{
+	const stm8_dev_t *dev = stm->dev;
+	parser_iter_t	it;
+	parser_seg_t	seg;
+	uint32_t	start, end, last, covered, base;
+	unsigned int	in_range = 0;
+	char		flash = 0, eeprom = 0, options = 0, kept;
+
+	fprintf(fp_stdout,"\n");
+
+	if (get_range(dev, op, &start, &end) != 0)
+		return 1;
+
+	/* find out what the image holds, a binary is placed at the range start */
+	parser_iter_init(&it, op->parser, op->p_st, start);
+	while (parser_next(&it, &seg) == PARSER_ERR_OK) {
+		if (seg.len == 0) continue;
+		last = seg.address + seg.len - 1;
+
+		if (op->range_flag) {
+			if (seg.address < end && last >= start) in_range = 1;
+			continue;
+		}
+
+		/* a segment may run from one area into the next, as the data EEPROM into the option bytes */
+		covered  = area_part(seg.address, last, dev->fl_start , dev->fl_end , &flash  );
+		covered += area_part(seg.address, last, dev->mem_start, dev->mem_end, &eeprom );
+		covered += area_part(seg.address, last, dev->opt_start, dev->opt_end, &options);
+		if (covered != seg.len) {
+			fprintf(fp_stderr, "File provided has data at 0x%08x-0x%08x, outside of the flash, data EEPROM and option bytes\n",
+				seg.address, last);
+			return 1;
+		}
+	}
+
+	if (op->range_flag) {
+		if (!in_range) {
+			fprintf(fp_stderr, "File provided has no data in range 0x%08x-0x%08x\n", start, end - 1);
+			return 1;
+		}
+
+		/* a range in the data EEPROM or option bytes goes to their writers */
+		if (start >= dev->mem_start && start <= dev->mem_end)
+			eeprom = 1;
+		else if (start >= dev->opt_start && start <= dev->opt_end)
+			options = 1;
+		else
+			flash = 1;
+	}
+
+	if (flash) {
+		/* a full write keeps the unit record, anything else makes it stale */
+		if (unit && !op->range_flag && op->erase == ERASE_ALL && npages == 0xFF) {
+			if (write_image_unit(op, start, end) != 0)
+				return 1;
+		} else if ((unit && unit_forget(unit) != 0) || write_image_flash(op, start, end, &kept) != 0)
+			return 1;
+	}
+
+	/* these keep to their area, and to the range if there is one */
+	base = start;
+	if (!op->range_flag) {
+		start = 0;
+		end   = UINT32_MAX;
+	}
+
+	if (eeprom && write_image_eeprom(op, base, start, end) != 0)
+		return 1;
+
+	if (options && write_image_options(op, base, start, end) != 0)
+		return 1;
+
+	return 0;
+}
+
+/*
+	the write the patch table goes with: the first one whose image has
+	data at a patched address, else the first one whose range takes them
+*/
+op_t *patch_target(void)
+{
+	parser_iter_t	it;
+	parser_seg_t	seg;
+	uint32_t	start, end, from, to;
+	op_t		*fallback = NULL;
+	int		i;
+
+	for (i = 0; i < op_count; ++i) {
+		if (ops[i].type != OP_WRITE || get_range(stm->dev, &ops[i], &start, &end) != 0)
+			continue;
+		if (!fallback && patch_overlaps(patch, start, end))
+			fallback = &ops[i];
+
+		parser_iter_init(&it, ops[i].parser, ops[i].p_st, start);
+		while (parser_next(&it, &seg) == PARSER_ERR_OK) {
+			from = seg.address > start ? seg.address : start;
+			to   = seg.address + seg.len < end ? seg.address + seg.len : end;
+			if (from < to && patch_overlaps(patch, from, to))
+				return &ops[i];
+		}
+	}
+	return fallback;
+}
+
+/* write an image, with the patch table laid over it if it is the one the table goes with */
+int op_write(op_t *op)
+{
+	parser_t	*parser = op->parser;
+	void		*storage = op->p_st;
+	uint32_t	start, end;
+	int		ret;
+
+	if (!patch || op != patch_op)
+		return write_image(op);
+
+	if (patch->spent) {
+		fprintf(fp_stderr, "%s has no values left for another unit\n", patch_filename);
+		return 1;
+	}
+
+	if (get_range(stm->dev, op, &start, &end) != 0)
+		return 1;
+
+	if (!(op->p_st = patch_open(patch, parser, storage, start))) {
+		fprintf(fp_stderr, "Out of memory applying %s\n", patch_filename);
+		op->p_st = storage;
+		return 1;
+	}
+	op->parser = &PARSER_PATCH;
+
+	ret = write_image(op);
+
+	PARSER_PATCH.close(op->p_st);
+	op->parser = parser;
+	op->p_st   = storage;
+	return ret;
+}
+
+/* write the changed bytes of an EEPROM image, a binary starts at the EEPROM start */
+int op_ee_write(op_t *op)
+{
+	const stm8_dev_t *dev = stm->dev;
+	parser_iter_t	it;
+	parser_seg_t	seg;
+	char		found = 0;
+
+	fprintf(fp_stdout,"\n");
+
+	parser_iter_init(&it, op->parser, op->p_st, dev->mem_start);
+	while (parser_next(&it, &seg) == PARSER_ERR_OK) {
+		if (seg.len == 0) continue;
+		if (seg.address < dev->mem_start || seg.address + seg.len - 1 > dev->mem_end) {
+			fprintf(fp_stderr, "File provided has data at 0x%08x-0x%08x, outside of the data EEPROM\n",
+				seg.address, seg.address + seg.len - 1);
+			return 1;
+		}
+		found = 1;
+	}
+
+	if (!found) {
+		fprintf(fp_stderr, "File provided has no EEPROM data\n");
+		return 1;
+	}
+
+	return write_image_eeprom(op, dev->mem_start, dev->mem_start, dev->mem_end + 1);
+}
+
+int op_erase(op_t *op)
+{
+	uint32_t start, end;
+
+	if (unit && unit_forget(unit) != 0)
+		return 1;
+
+	fprintf(fp_stdout, "\nErasing ");
+	if (!op->range_flag) {
+		fprintf(fp_stdout, "all flash... ");
+		fflush(fp_stdout);
+		if (!stm8_erase_memory(stm, 0xFF)) {
+			fprintf(fp_stderr, "Failed to erase flash\n");
+			return 1;
+		}
+	} else {
+		if (get_range(stm->dev, op, &start, &end) != 0)
+			return 1;
+		fprintf(fp_stdout, "0x%08x-0x%08x... ", start, end - 1);
+		fflush(fp_stdout);
+		if (!erase_range(stm, start, end)) {
+			fprintf(fp_stderr, "Failed to erase memory range 0x%08x-0x%08x\n", start, end - 1);
+			return 1;
+		}
+	}
+	fprintf(fp_stdout, "Done.\n");
+	return 0;
+}
+
+int op_options(op_t *op)
+{
+	optbytes_t	opt;
+	int		i;
+
+	fprintf(fp_stdout,"\n");
+	if (!optbytes_read(stm, &opt)) {
+		fprintf(fp_stderr, "Failed to read option bytes, target read-out protected?\n");
+		return 1;
+	}
+	if (op->value)
+		optbytes_print(&opt, fp_stdout);
+	optbytes_check(&opt, fp_stderr);
+
+	for (i = 0; i < op->nassign; ++i)
+		if (optbytes_set(&opt, op->assign[i]) != 0) {
+			fprintf(fp_stderr, "Invalid option byte assignment %s\n", op->assign[i]);
+			return 1;
+		}
+
+	if (optbytes_changed(&opt)) {
+		fprintf(fp_stdout, "Writing option bytes... ");
+		fflush(fp_stdout);
+		if (!optbytes_write(stm, &opt, verify))
+			return 1;
+		fprintf(fp_stdout, "Done.\n");
+		if (op->value)
+			optbytes_print(&opt, fp_stdout);
+	} else if (op->nassign)
+		fprintf(fp_stdout, "Option bytes already up to date.\n");
+
+	return 0;
+}
+
+/* load an image into the RAM above the E/W routines, it is started when the session ends */
+int op_ram_load(op_t *op)
+{
+	const stm8_dev_t *dev = stm->dev;
+	uint32_t	low   = stm->routine_end;
+	uint32_t	high  = dev->ram_end + 1 - STM8_RAM_STACK_SIZE;
+	uint8_t		data[dev->ram_end + 1 - dev->ram_start];
+	uint8_t		compare[256];
+	uint8_t		*image = data;
+	uint32_t	start = low;
+	parser_iter_t	it;
+	parser_seg_t	seg;
+	unsigned int	len, i, n;
+
+	fprintf(fp_stdout,"\n");
+
+	/* the image has to be one block of RAM, a binary is placed at the -a address */
+	parser_iter_init(&it, op->parser, op->p_st, op->range_flag ? op->range_start : low);
+	for (len = 0; parser_next(&it, &seg) == PARSER_ERR_OK; ) {
+		if (len == 0) start = seg.address;
+		if (seg.address + seg.len - start > sizeof(data)) {
+			fprintf(fp_stderr, "File provided has data outside of RAM\n");
+			return 1;
+		}
+
+		/* gaps between the segments are loaded as zero */
+		memset(&data[len], 0, seg.address - start - len);
+		memcpy(&data[seg.address - start], seg.data, seg.len);
+		len = seg.address + seg.len - start;
+	}
+
+	if (len == 0) {
+		fprintf(fp_stderr, "File provided is empty\n");
+		return 1;
+	}
+
+	if (start < low || start + len > high) {
+		fprintf(fp_stderr, "Image 0x%08x-0x%08x does not fit the free RAM 0x%08x-0x%08x\n",
+			start, start + len - 1, low, high - 1);
+		return 1;
+	}
 
-#include "utils.h"
-#include "serial.h"
-#include "stm8.h"
-#include "parser.h"
+	fprintf(fp_stdout, "Loading %u bytes to RAM at 0x%08x... ", len, start);
+	fflush(fp_stdout);
+	for (i = 0; i < len; i += n) {
+		n = len - i > 128 ? 128 : len - i;
+		if (!stm8_write_memory(stm, start + i, &image[i], n)) {
+			fprintf(fp_stderr, "Failed to write RAM at address 0x%08x\n", start + i);
+			return 1;
+		}
+	}
 
-#ifdef LANTRONIX_CPM
-#endif
+	if (verify)
+		for (i = 0; i < len; i += n) {
+			n = len - i > sizeof(compare) ? sizeof(compare) : len - i;
+			if (!stm8_read_memory(stm, start + i, compare, n) || memcmp(compare, &image[i], n) != 0) {
+				fprintf(fp_stderr, "Failed to verify RAM at address 0x%08x\n", start + i);
+				return 1;
+			}
+		}
+	fprintf(fp_stdout, "Done.\n");
 
-#include "parsers/binary.h"
-#include "parsers/hex.h"
+	/* start at the load address unless -g gave one */
+	if (!exec_flag || !execute) {
+		exec_flag = 1;
+		execute   = start;
+	}
+	return 0;
+}
 
-FILE *fp_stdout;
-FILE *fp_stderr;
+/*
+	check the device against a manifest, one region per line:
 
-/* device globals */
-serial_t	*serial		= NULL;
-stm8_t		*stm		= NULL;
+		start[:length] [crc]
 
-void		*p_st		= NULL;
-parser_t	*parser		= NULL;
+	the CRCs are computed on the target. A region given without a CRC is
+	printed with the one found, so the manifest of a known good unit
+	comes from running the same audit on it
+*/
+int op_audit(op_t *op)
+{
+	FILE		*fp;
+	char		line[256], *tok, *end;
+	stm8_digest_t	digest[256];
+	long		expect[256];
+	unsigned int	count = 0, i, bad = 0;
+	uint32_t	start, stop;
+	int		lineno = 0;
+	op_t		range;
+
+	if (!(fp = fopen(op->filename, "r"))) {
+		perror(op->filename);
+		return 1;
+	}
 
-/* settings */
-char		*device		= NULL;
-serial_baud_t	baudRate	= SERIAL_BAUD_115200;
-int		rd	 	= 0;
-int		wr		= 0;
-int		wu		= 0;
-int 		eb 		= 0;
-int		dtr_reset	= 0;
-int		cpm_reset_flag	= 0;
-int 	        redirect_stderr_stdout = 0;
+	memset(&range, 0, sizeof(range));
+	range.range_flag = 1;
+	while (fgets(line, sizeof(line), fp)) {
+		++lineno;
+		if ((tok = strchr(line, '#'))) *tok = 0;
+		if (!(tok = strtok(line, " \t\r\n"))) continue;
 
-int		npages		= 0xFF;
-char		verify		= 0;
-int		retry		= 10;
-char		exec_flag	= 0;
-uint32_t	execute		= 0;
-char		init_flag	= 1;
-char		force_binary	= 0;
-char		reset_flag	= 1;
-char		*filename;
+		if (count == sizeof(digest) / sizeof(digest[0])) {
+			fprintf(fp_stderr, "%s:%d: too many regions\n", op->filename, lineno);
+			goto error;
+		}
+		if (parse_range(tok, &range.range_start, &range.range_len) != 0) {
+			fprintf(fp_stderr, "%s:%d: invalid range %s\n", op->filename, lineno, tok);
+			goto error;
+		}
+		if (get_range(stm->dev, &range, &start, &stop) != 0)
+			goto error;
+
+		expect[count] = -1;
+		if ((tok = strtok(NULL, " \t\r\n"))) {
+			expect[count] = strtoul(tok, &end, 0);
+			if (*end || expect[count] > 0xFFFF || strtok(NULL, " \t\r\n")) {
+				fprintf(fp_stderr, "%s:%d: expected start[:length] [crc]\n", op->filename, lineno);
+				goto error;
+			}
+		}
 
-/* functions */
-int  parse_options(int argc, char *argv[]);
-void show_help(char *name);
+		digest[count].address	= start;
+		digest[count].len	= stop - start;
+		++count;
+	}
+	fclose(fp);
 
-#ifdef LANTRONIX_CPM
-void cpm_reset()
-{
-	system("cpm -N STM8_RESET -V 1");
-	system("cpm -N STM8_RESET -V 0");
-	usleep(50000);
+	fprintf(fp_stdout, "\nAuditing %u regions from %s... ", count, op->filename);
+	fflush(fp_stdout);
+	if (!stm8_digest(stm, digest, count)) {
+		fprintf(fp_stderr, "Failed to compute the digests on the device\n");
+		return 1;
+	}
+	fprintf(fp_stdout, "Done.\n");
+
+	for (i = 0; i < count; ++i) {
+		if (expect[i] < 0) {
+			fprintf(fp_stdout, "0x%08x:0x%x 0x%04x\n", digest[i].address, digest[i].len, digest[i].crc);
+			continue;
+		}
+		if (expect[i] == digest[i].crc) {
+			fprintf(fp_stdout, "0x%08x:0x%x 0x%04x match\n", digest[i].address, digest[i].len, digest[i].crc);
+			continue;
+		}
+		fprintf(fp_stdout, "0x%08x:0x%x 0x%04x MISMATCH, expected 0x%04lx%s\n", digest[i].address,
+			digest[i].len, digest[i].crc, expect[i], digest[i].blank ? " (erased)" : "");
+		++bad;
+	}
+
+	if (bad) {
+		fprintf(fp_stderr, "%u of %u regions do not match %s\n", bad, count, op->filename);
+		return 1;
+	}
+	return 0;
+
+error:
+	fclose(fp);
+	return 1;
 }
-#endif
 
-int isMemZero(uint8_t *data, int len)
+/* what the writes and erases of the session took */
+void show_timing(const stm8_timing_t *t)
 {
-	if(len <= 0) return 0;
+	if (t->units[STM8_TIME_WRITE])
+		fprintf(fp_stdout, "\nWrites       : %u in %u ms (%.2f ms each)", t->units[STM8_TIME_WRITE],
+			(unsigned int)(t->spent[STM8_TIME_WRITE] / 1000),
+			t->spent[STM8_TIME_WRITE] / 1000.0 / t->units[STM8_TIME_WRITE]);
+	if (t->units[STM8_TIME_ERASE])
+		fprintf(fp_stdout, "\nErases       : %u sectors in %u ms (%.2f ms each)", t->units[STM8_TIME_ERASE],
+			(unsigned int)(t->spent[STM8_TIME_ERASE] / 1000),
+			t->spent[STM8_TIME_ERASE] / 1000.0 / t->units[STM8_TIME_ERASE]);
+	if (t->units[STM8_TIME_WRITE] || t->units[STM8_TIME_ERASE])
+		fprintf(fp_stdout, "\n");
+}
 
-	do {
-		len--;
-		if(data[len]) return 0;
-	} while(len);
-	
+int run_op(op_t *op)
+{
+	switch(op->type) {
+		case OP_READ:
+		case OP_EE_READ:	return op_read(op);
+		case OP_WRITE:		return op_write(op);
+		case OP_EE_WRITE:	return op_ee_write(op);
+		case OP_ERASE:		return op_erase(op);
+		case OP_OPTIONS:	return op_options(op);
+		case OP_RAM_LOAD:	return op_ram_load(op);
+		case OP_VERIFY:
+			verify	     = op->value != 0;
+			verify_after = op->value == 2;
+			return 0;
+		case OP_AUDIT:		return op_audit(op);
+	}
 	return 1;
 }
-		
 
 int main(int argc, char* argv[]) {
 	int ret = 1;
-	parser_err_t perr;
-
-	
+	int i;
 
 	fp_stdout = stdout; fp_stderr = stderr;
 
 
-	fprintf(fp_stdout,"stm8flash based on stm32flash - http://stm32flash.googlecode.com/\n\n");
 	if (parse_options(argc, argv) != 0)
 		goto close;
 
+	/* a dump to the standard output has it to itself, the messages go to stderr */
+	for (i = 0; i < op_count; ++i)
+		if ((ops[i].type == OP_READ || ops[i].type == OP_EE_READ) && strcmp(ops[i].filename, "-") == 0)
+			fp_stdout = fp_stderr;
+
+	fprintf(fp_stdout,"stm8flash based on stm32flash - http://stm32flash.googlecode.com/\n\n");
+
 	if(redirect_stderr_stdout)
 	{
 		fp_stdout=fopen("/tmp/stm8flasher.stdout","a");
 		fp_stderr=fopen("/tmp/stm8flasher.stderr","a");	
 	}
 
-	if (wr) {
-		/* first try hex */
-		if (!force_binary) {
-			parser = &PARSER_HEX;
-			p_st = parser->init();
-			if (!p_st) {
-				fprintf(fp_stderr, "%s Parser failed to initialize\n", parser->name);
-				goto close;
-			}
-		}
-
-		if (force_binary || (perr = parser->open(p_st, filename, 0)) != PARSER_ERR_OK) {
-			if (force_binary || perr == PARSER_ERR_INVALID_FILE) {
-				if (!force_binary) {
-					parser->close(p_st);
-					p_st = NULL;
-				}
+	/* build a container from the image and stop, no device is involved */
+	if (compile_filename) {
+		parser_t	*p;
+		void		*st;
+		parser_iter_t	it;
 
-				/* now try binary */
-				parser = &PARSER_BINARY;
-				p_st = parser->init();
-				if (!p_st) {
-					fprintf(fp_stderr, "%s Parser failed to initialize\n", parser->name);
-					goto close;
-				}
-				perr = parser->open(p_st, filename, 0);
-			}
+		if (open_image(filename, &p, &st) != 0)
+			goto close;
+		fprintf(fp_stdout, "Using Parser : %s (%s)\n", p->name, filename);
+
+		/* a binary has no address of its own, it goes to -a or the STM8 flash start */
+		parser_iter_init(&it, p, st, range_flag ? range_start : 0x8000);
+		ret = framed_compile(&it, compile_filename);
+		p->close(st);
+		if (ret == 0)
+			fprintf(fp_stdout, "Wrote %s\n", compile_filename);
+		goto close;
+	}
 
-			/* if still have an error, fail */
-			if (perr != PARSER_ERR_OK) {
-				fprintf(fp_stderr, "%s ERROR: %s\n", parser->name, parser_errstr(perr));
-				if (perr == PARSER_ERR_SYSTEM) perror(filename);
-				goto close;
-			}
-		}
+	/* open all images up front so a bad file fails before connecting */
+	for (i = 0; i < op_count; ++i) {
+		if (ops[i].type != OP_WRITE && ops[i].type != OP_EE_WRITE && ops[i].type != OP_RAM_LOAD) continue;
 
-		fprintf(fp_stdout, "Using Parser : %s\n", parser->name);
-	} else {
-		parser = &PARSER_BINARY;
-		p_st = parser->init();
-		if (!p_st) {
-			fprintf(fp_stderr, "%s Parser failed to initialize\n", parser->name);
+		if (open_image(ops[i].filename, &ops[i].parser, &ops[i].p_st) != 0)
 			goto close;
-		}
+
+		fprintf(fp_stdout, "Using Parser : %s (%s)\n", ops[i].parser->name, ops[i].filename);
 	}
 
+	if (patch_filename && !(patch = patch_load(patch_filename)))
+		goto close;
+
+#ifndef __WIN32__
+	/* kill -USR1 shows the command statistics so far on a long run */
+	signal(SIGUSR1, stm8_stats_signal);
+#endif
+
+	if (trace_filename && trace_start(trace_filename) != 0)
+		goto close;
+
 	serial = serial_open(device);
 	if (!serial) {
 		perror(device);
@@ -198,6 +1881,18 @@ int main(int argc, char* argv[]) {
 	if (!(stm = stm8_init(serial, init_flag))) goto close;
 
 	fprintf(fp_stdout,"BL-Version   : 0x%02x\n", stm->bl_version);
+
+	if (unit_dir) {
+		uint8_t id[UNIT_ID_LEN];
+
+		if (!stm8_read_memory(stm, stm->dev->uid, id, sizeof(id))) {
+			fprintf(fp_stderr, "Failed to read the unique ID\n");
+			goto close;
+		}
+		if (!(unit = unit_open(unit_dir, id)))
+			goto close;
+		fprintf(fp_stdout,"Unit ID      : %s%s\n", unit->id, unit->hash ? "" : " (new)");
+	}
 /*	fprintf(fp_stdout,"Option 1     : 0x%02x\n", stm->option1);
 	fprintf(fp_stdout,"Option 2     : 0x%02x\n", stm->option2);
 	fprintf(fp_stdout,"Device ID    : 0x%04x (%s)\n", stm->pid, stm->dev->name);
@@ -207,141 +1902,31 @@ int main(int argc, char* argv[]) {
 	fprintf(fp_stdout,"System RAM   : %dKiB\n", (stm->dev->mem_end - stm->dev->mem_start) / 1024);
 */
 
-	uint8_t		buffer[256];
-	uint8_t		wbuffer[128];
-	uint32_t	addr;
-	unsigned int	len;
-	int		failed = 0;
-
-	if (rd) {
-		fprintf(fp_stdout,"\n");
-
-		if ((perr = parser->open(p_st, filename, 1)) != PARSER_ERR_OK) {
-			fprintf(fp_stderr, "%s ERROR: %s\n", parser->name, parser_errstr(perr));
-			if (perr == PARSER_ERR_SYSTEM) perror(filename);
-			goto close;
-		}
-
-		addr = stm->dev->fl_start;
-		fprintf(fp_stdout, "\x1B[s");
-		fflush(fp_stdout);
-		while(addr < stm->dev->fl_end) {
-			uint32_t left	= stm->dev->fl_end - addr;
-			len		= sizeof(buffer) > left ? left : sizeof(buffer);
-			if (!stm8_read_memory(stm, addr, buffer, len)) {
-				fprintf(fp_stderr, "Failed to read memory at address 0x%08x, target write-protected?\n", addr);
-				goto close;
-			}
-			assert(parser->write(p_st, buffer, len) == PARSER_ERR_OK);
-			addr += len;
-
-			fprintf(fp_stdout,
-				"\x1B[uRead address 0x%08x (%.2f%%) ",
-				addr,
-				(100.0f / (float)(stm->dev->fl_end - stm->dev->fl_start)) * (float)(addr - stm->dev->fl_start)
-			);
-			fflush(fp_stdout);
-		}
-		fprintf(fp_stdout,	"Done.\n");
-		ret = 0;
-		goto close;
-
-	} else if (wu) {
-
 //FIXME: Write-unprotecting on STM8 ????
+//	if (wu) {
 //		fprintf(fp_stdout, "Write-unprotecting flash\n");
 		/* the device automatically performs a reset after the sending the ACK */
 //		reset_flag = 0;
 //		stm8_wunprot_memory(stm);
 //		fprintf(fp_stdout,	"Done.\n");
+//	}
 //FIXME: END
-	} else if (eb) {
-
-		addr = 0x487E; //OPTBL
-		if (!stm8_write_memory(stm, addr, (uint8_t *)"\x55\xAA", 2)) {
-			fprintf(fp_stderr, "Failed to OPTION Bytes memory at address 0x%08x\n", addr);
-			goto close;
-		}
-
-	} else if (wr) {
-		fprintf(fp_stdout,"\n");
-
-		off_t 	offset = 0;
-		ssize_t r;
-		unsigned int size = parser->size(p_st);
 
-		// Binaryfiles are put at beginning of Flash (0x8000) - Intel Hexfiles include the correct adress
-		if(parser == &PARSER_HEX) size -= 0x8000;
+	if (patch && !(patch_op = patch_target())) {
+		fprintf(fp_stderr, "No write takes the addresses of %s\n", patch_filename);
+		goto close;
+	}
 
-		if (size > stm->dev->fl_end - stm->dev->fl_start) {
-			fprintf(fp_stderr,"Size: %d Flash-Start: %x Flash-End: %x\n", size, stm->dev->fl_start, stm->dev->fl_end);
-			fprintf(fp_stderr, "File provided larger then available flash space.\n");
+	for (i = 0; i < op_count; ++i)
+		if (run_op(&ops[i]) != 0)
 			goto close;
-		}
-
-		stm8_erase_memory(stm, npages);
-
-		addr = stm->dev->fl_start;
-		fprintf(fp_stdout, "\x1B[s");
-		fflush(fp_stdout);
-		while(addr < stm->dev->fl_end && offset < size) {
-			uint32_t left	= stm->dev->fl_end - addr;
-			len		= sizeof(wbuffer) > left ? left : sizeof(wbuffer);
-			len		= len > size - offset ? size - offset : len;
-
-			if (parser->read(p_st, wbuffer, &len) != PARSER_ERR_OK)
-				goto close;
-	
-			again:
-			if(!isMemZero(wbuffer,len))
-			{
-				if (!stm8_write_memory(stm, addr, wbuffer, len)) {
-					fprintf(fp_stderr, "Failed to write memory at address 0x%08x\n", addr);
-					goto close;
-				}
-			}
-			if (verify) {
-				uint8_t compare[len];
-				if (!stm8_read_memory(stm, addr, compare, len)) {
-					fprintf(fp_stderr, "Failed to read memory at address 0x%08x\n", addr);
-					goto close;
-				}
-
-				for(r = 0; r < len; ++r)
-					if (wbuffer[r] != compare[r]) {
-						if (failed == retry) {
-							fprintf(fp_stderr, "Failed to verify at address 0x%08x, expected 0x%02x and found 0x%02x\n",
-								(uint32_t)(addr + r),
-								wbuffer [r],
-								compare[r]
-							);
-							goto close;
-						}
-						++failed;
-						goto again;
-					}
-
-				failed = 0;
-			}
-
-			addr	+= len;
-			offset	+= len;
 
-			fprintf(fp_stdout,
-				"\x1B[uWrote %saddress 0x%08x (%.2f%%) ",
-				verify ? "and verified " : "",
-				addr,
-				(100.0f / size) * offset
-			);
-			fflush(fp_stdout);
-
-		}
-
-		fprintf(fp_stdout,	"Done.\n");
-		ret = 0;
+	/* the unit took one set of values, the next one gets the following */
+	if (patch_op && patch_commit(patch) != 0)
 		goto close;
-	} else
-		ret = 0;
+
+	ret = 0;
+	show_timing(stm->timing);
 
 close:
 	if (stm && exec_flag && ret == 0) {
@@ -375,21 +1960,46 @@ close:
 		}
 	}
 
-	if (p_st  ) parser->close(p_st);
+	for (i = 0; i < op_count; ++i) {
+		if (ops[i].p_st) ops[i].parser->close(ops[i].p_st);
+		free(ops[i].text);
+	}
+	if (patch ) patch_free  (patch);
+	if (unit  ) unit_free   (unit);
+	if (stm && show_stats) stm8_stats_print(stm, fp_stderr);
 	if (stm   ) stm8_close  (stm);
 	if (serial) serial_close (serial);
+	trace_stop();
 //	if (redirect_stderr_stdout)
 	{
 		fclose(fp_stderr);
-		fclose(fp_stdout);
+		if (fp_stdout != fp_stderr) fclose(fp_stdout);
 	}
 	fprintf(fp_stdout,"\n");
 	return ret;
 }
 
+/* append an operation, returns NULL when the list is full */
+op_t *add_op(op_type_t type, char *name)
+{
+	op_t *op;
+
+	if (op_count == sizeof(ops) / sizeof(ops[0])) {
+		fprintf(fp_stderr, "ERROR: Too many operations\n");
+		return NULL;
+	}
+
+	op = &ops[op_count++];
+	memset(op, 0, sizeof(*op));
+	op->type	= type;
+	op->filename	= name;
+	return op;
+}
+
 int parse_options(int argc, char *argv[]) {
+	char go_given = 0;
 	int c;
-	while((c = getopt(argc, argv, "b:r:w:e:vn:g:fchudsql")) != -1) {
+	while((c = getopt(argc, argv, "b:r:w:e:a:A:E:R:o:OS:x:C:K:P:U:t:vVTn:g:fzchudsql")) != -1) {
 		switch(c) {
 			case 'b':
 				baudRate = serial_get_baud(strtoul(optarg, NULL, 0));
@@ -402,16 +2012,37 @@ int parse_options(int argc, char *argv[]) {
 				break;
 			case 'r':
 			case 'w':
-			case 'l':
 				rd = rd || c == 'r';
 				wr = wr || c == 'w';
-				eb = eb || c == 'l';
-				if ((rd && wr) || (rd && eb) || (wr && eb) ) {
-					fprintf(fp_stderr, "ERROR: Invalid options, can't read & write or enable bootloader at the same time\n");
+				if (rd && wr) {
+					fprintf(fp_stderr, "ERROR: Invalid options, can't read & write at the same time\n");
 					return 1;
 				}
 				filename = optarg;
 				break;
+			case 'l':
+				eb = 1;
+				break;
+			case 'o':
+				if (opt_count == sizeof(opt_assign) / sizeof(opt_assign[0])) {
+					fprintf(fp_stderr, "ERROR: Too many option byte assignments\n");
+					return 1;
+				}
+				opt_assign[opt_count++] = optarg;
+				break;
+			case 'O':
+				opt_print = 1;
+				break;
+			case 'E':
+			case 'R':
+				ee_wr = ee_wr || c == 'E';
+				ee_rd = ee_rd || c == 'R';
+				if (ee_rd && ee_wr) {
+					fprintf(fp_stderr, "ERROR: Invalid options, can't read & write the EEPROM at the same time\n");
+					return 1;
+				}
+				ee_filename = optarg;
+				break;
 			case 'e':
 				npages = strtoul(optarg, NULL, 0);
 				if (npages > 0xFF || npages < 0) {
@@ -419,6 +2050,35 @@ int parse_options(int argc, char *argv[]) {
 					return 1;
 				}
 				break;
+			case 'a':
+				if (parse_range(optarg, &range_start, &range_len) != 0) {
+					fprintf(fp_stderr, "ERROR: Invalid range, expected start[:length]\n");
+					return 1;
+				}
+				range_flag = 1;
+				break;
+			case 'S':
+				script = optarg;
+				break;
+			case 'C':
+				compile_filename = optarg;
+				break;
+			case 'K':
+				cache_dir = optarg;
+				break;
+			case 'P':
+				patch_filename = optarg;
+				break;
+			case 'A':
+				audit_filename = optarg;
+				break;
+			case 'U':
+				unit_dir = optarg;
+				break;
+
+			case 'x':
+				ram_filename = optarg;
+				break;
 			case 'u':
 				wu = 1;
 				if (rd || wr) {
@@ -429,13 +2089,22 @@ int parse_options(int argc, char *argv[]) {
 			case 'v':
 				verify = 1;
 				break;
+			case 'V':
+				verify = verify_after = 1;
+				break;
+			case 'T':
+				show_stats = 1;
+				break;
+			case 't':
+				trace_filename = optarg;
+				break;
 
 			case 'n':
 				retry = strtoul(optarg, NULL, 0);
 				break;
 
 			case 'g':
-				exec_flag = 1;
+				exec_flag = go_given = 1;
 				execute   = strtoul(optarg, NULL, 0);
 				break;
 
@@ -443,6 +2112,10 @@ int parse_options(int argc, char *argv[]) {
 				force_binary = 1;
 				break;
 
+			case 'z':
+				skip_erased = 1;
+				break;
+
 			case 'c':
 				init_flag = 0;
 				break;
@@ -470,34 +2143,288 @@ int parse_options(int argc, char *argv[]) {
 		device = argv[c];
 	}
 
+	if (compile_filename) {
+		if (!wr || device || rd || ee_rd || ee_wr || script || ram_filename || audit_filename) {
+			fprintf(fp_stderr, "ERROR: Invalid usage, -C only takes an image to write (-w) and no device\n");
+			show_help(argv[0]);
+			return 1;
+		}
+		return 0;
+	}
+
 	if (device == NULL) {
 		fprintf(fp_stderr, "ERROR: Device not specified\n");
 		show_help(argv[0]);
 		return 1;
 	}
 
-	if (!wr && verify) {
-		fprintf(fp_stderr, "ERROR: Invalid usage, -v is only valid when writing\n");
+	if (!wr && !ee_wr && !opt_count && !eb && !script && !ram_filename && verify) {
+		fprintf(fp_stderr, "ERROR: Invalid usage, -v and -V are only valid when writing\n");
+		show_help(argv[0]);
+		return 1;
+	}
+
+	if (patch_filename && !wr && !script) {
+		fprintf(fp_stderr, "ERROR: Invalid usage, -P is only valid when writing the flash\n");
+		show_help(argv[0]);
+		return 1;
+	}
+
+	if (range_flag && !rd && !wr && !ram_filename) {
+		fprintf(fp_stderr, "ERROR: Invalid usage, -a is only valid when reading, writing or loading to RAM\n");
 		show_help(argv[0]);
 		return 1;
 	}
 
+	/* the command line operations, in the order they always ran */
+	op_t *op;
+	if (ee_rd && !add_op(OP_EE_READ, ee_filename)) return 1;
+	if (ee_wr && !add_op(OP_EE_WRITE, ee_filename)) return 1;
+	if (rd || wr) {
+		if (!(op = add_op(rd ? OP_READ : OP_WRITE, filename))) return 1;
+		op->range_flag	= range_flag;
+		op->range_start	= range_start;
+		op->range_len	= range_len;
+		op->erase	= range_flag ? ERASE_RANGE : ERASE_ALL;
+	}
+	if (audit_filename && !add_op(OP_AUDIT, audit_filename)) return 1;
+
+	/* option bytes go last, after the flash and EEPROM contents are in place */
+	if (opt_print || opt_count || eb) {
+		if (!(op = add_op(OP_OPTIONS, NULL))) return 1;
+		op->value = opt_print;
+		if (eb) op->assign[op->nassign++] = "OPTBL=0x55";
+		if (op->nassign + opt_count > sizeof(op->assign) / sizeof(op->assign[0])) {
+			fprintf(fp_stderr, "ERROR: Too many option byte assignments\n");
+			return 1;
+		}
+		for (c = 0; c < opt_count; ++c)
+			op->assign[op->nassign++] = opt_assign[c];
+	}
+
+	if (script && parse_script(script) != 0)
+		return 1;
+
+	/* a script may have no write for the patch table to go with */
+	for (c = 0; patch_filename && c < op_count && ops[c].type != OP_WRITE; ++c);
+	if (patch_filename && c == op_count) {
+		fprintf(fp_stderr, "ERROR: Invalid usage, -P is only valid when writing the flash\n");
+		return 1;
+	}
+
+	/* both would say where to start */
+	if (go_given && script_go) {
+		fprintf(fp_stderr, "ERROR: Invalid usage, -g can't be used with a script that ends with go\n");
+		return 1;
+	}
+
+	/* starting the RAM image ends the session, so it goes last */
+	if (ram_filename) {
+		if (!(op = add_op(OP_RAM_LOAD, ram_filename))) return 1;
+		op->range_flag	= range_flag && !rd && !wr;
+		op->range_start	= range_start;
+	}
+
+	return 0;
+}
+
+/*
+	parse a session script, one operation per line:
+
+	read <file> [start[:length]]
+	write <file> [start[:length]]	erases only the sectors that are written
+	eeprom-read <file>
+	eeprom-write <file>
+	erase all|start[:length]
+	options [show] [name=value ...]
+	verify on|off|after
+	audit <manifest>
+	go [address]			must be the last operation
+	ram-go <file> [address]		load file into RAM and start it, must be the last operation
+*/
+int parse_script(const char *name) {
+	FILE	*fp;
+	char	line[512];
+	char	*argv[20], *tok, *text = NULL;
+	int	argc, i, lineno = 0;
+	char	ended = 0;	/* a go or ram-go was seen, nothing may follow */
+	op_t	*op = NULL;
+
+	if (!(fp = fopen(name, "r"))) {
+		perror(name);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		++lineno;
+		if ((tok = strchr(line, '#'))) *tok = 0;
+
+		/* a copy of the line is kept with its operation, which points into it */
+		op = NULL;
+		if (!(text = strdup(line))) {
+			fprintf(fp_stderr, "Out of memory\n");
+			goto error;
+		}
+		argc = 0;
+		for (tok = strtok(text, " \t\r\n"); tok && argc < 20; tok = strtok(NULL, " \t\r\n"))
+			argv[argc++] = tok;
+		if (argc == 0) {
+			free(text);
+			continue;
+		}
+
+		if (ended) {
+			fprintf(fp_stderr, "%s:%d: go must be the last operation\n", name, lineno);
+			goto error;
+		}
+
+		if (!strcmp(argv[0], "read") || !strcmp(argv[0], "write")) {
+			if (argc < 2 || argc > 3) goto usage;
+			if (!(op = add_op(argv[0][0] == 'r' ? OP_READ : OP_WRITE, argv[1]))) goto error;
+			op->erase = ERASE_RANGE;
+			if (argc == 3) {
+				if (parse_range(argv[2], &op->range_start, &op->range_len) != 0) goto usage;
+				op->range_flag = 1;
+			}
+		} else if (!strcmp(argv[0], "eeprom-read") || !strcmp(argv[0], "eeprom-write")) {
+			if (argc != 2) goto usage;
+			if (!(op = add_op(argv[0][7] == 'r' ? OP_EE_READ : OP_EE_WRITE, argv[1]))) goto error;
+		} else if (!strcmp(argv[0], "erase")) {
+			if (argc != 2) goto usage;
+			if (!(op = add_op(OP_ERASE, NULL))) goto error;
+			if (strcmp(argv[1], "all")) {
+				if (parse_range(argv[1], &op->range_start, &op->range_len) != 0) goto usage;
+				op->range_flag = 1;
+			}
+		} else if (!strcmp(argv[0], "options")) {
+			if (!(op = add_op(OP_OPTIONS, NULL))) goto error;
+			for (i = 1; i < argc; ++i) {
+				if (!strcmp(argv[i], "show"))
+					op->value = 1;
+				else if (op->nassign == sizeof(op->assign) / sizeof(op->assign[0])) {
+					fprintf(fp_stderr, "%s:%d: too many option byte assignments\n", name, lineno);
+					goto error;
+				} else
+					op->assign[op->nassign++] = argv[i];
+			}
+		} else if (!strcmp(argv[0], "verify")) {
+			if (argc != 2 || (strcmp(argv[1], "on") && strcmp(argv[1], "off") && strcmp(argv[1], "after"))) goto usage;
+			if (!(op = add_op(OP_VERIFY, NULL))) goto error;
+			op->value = !strcmp(argv[1], "on") ? 1 : !strcmp(argv[1], "after") ? 2 : 0;
+		} else if (!strcmp(argv[0], "audit")) {
+			if (argc != 2) goto usage;
+			if (!(op = add_op(OP_AUDIT, argv[1]))) goto error;
+		} else if (!strcmp(argv[0], "ram-go")) {
+			if (argc < 2 || argc > 3) goto usage;
+			if (!(op = add_op(OP_RAM_LOAD, argv[1]))) goto error;
+			if (argc == 3) {
+				op->range_start = strtoul(argv[2], NULL, 0);
+				op->range_flag  = 1;
+			}
+			/* nothing may follow, the image is started when the session ends */
+			exec_flag = ended = 1;
+		} else if (!strcmp(argv[0], "go")) {
+			if (argc > 2) goto usage;
+			exec_flag = ended = script_go = 1;
+			execute   = argc == 2 ? strtoul(argv[1], NULL, 0) : 0;
+		} else {
+			fprintf(fp_stderr, "%s:%d: unknown operation %s\n", name, lineno, argv[0]);
+			goto error;
+		}
+
+		if (op) op->text = text;
+		else    free(text);
+	}
+
+	fclose(fp);
 	return 0;
+
+usage:
+	fprintf(fp_stderr, "%s:%d: invalid arguments for %s\n", name, lineno, argv[0]);
+error:
+	if (op) op->text = text;
+	else    free(text);
+	fclose(fp);
+	return 1;
+}
+
+/* parse "start[:length]", a missing length means up to the end of the memory area */
+int parse_range(const char *arg, uint32_t *start, uint32_t *len) {
+	char *end;
+
+	*start = strtoul(arg, &end, 0);
+	if (end == arg) return 1;
+
+	*len = 0;
+	if (*end == ':') {
+		arg  = end + 1;
+		*len = strtoul(arg, &end, 0);
+		if (end == arg || *len == 0) return 1;
+	}
+
+	return *end != 0;
 }
 
 void show_help(char *name) {
 	fprintf(stderr,
-		"Usage: %s [-bvngfhc] [-[rw] filename] /dev/ttyS0\n"
+		"Usage: %s [-bvVTngfzhcO] [-a start:length] [-[rw] filename] [-[ER] filename] [-o name=value] [-S script] [-x filename] [-K dir] [-P table] [-U dir] [-A manifest] [-t trace] /dev/ttyS0\n"
+		"       %s -w filename [-a start] -C container\n"
 		"	-b rate		Baud rate (default 115200)\n"
-		"	-r filename	Read flash to file\n"
-		"	-w filename	Write flash to file\n"
-		"	-l		Enable STM8 Bootloader OPTION-Bytes\n"
+		"	-r filename	Read flash to file, Intel HEX for .hex/.ihx and\n"
+		"			S-records for .s19/.s28/.s37/.srec/.mot files. An interrupted\n"
+		"			binary read carries on where it stopped when run again.\n"
+		"			A filename of - writes a binary to the standard output\n"
+		"	-w filename	Write flash from file (Intel HEX, S-records, ELF or binary)\n"
+		"	-E filename	Write data EEPROM from file (only changed bytes are sent)\n"
+		"	-R filename	Read data EEPROM to file\n"
+		"	-l		Enable STM8 Bootloader OPTION-Bytes (same as -o OPTBL=0x55)\n"
+		"	-o name=value	Set an option byte by name (OPT0..OPT7, OPTBL) or address,\n"
+		"			the complement byte is set as well. Only changed bytes are\n"
+		"			written, after any flash and EEPROM writes\n"
+		"	-O		Show the decoded option bytes\n"
+		"	-S script	Run the operations listed in script in one session,\n"
+		"			after any given on the command line. One per line:\n"
+		"			  read|write file [start[:length]]\n"
+		"			  eeprom-read|eeprom-write file\n"
+		"			  erase all|start[:length]\n"
+		"			  options [show] [name=value ...]\n"
+		"			  verify on|off|after (as -v/-V for the writes that follow)\n"
+		"			  audit manifest\n"
+		"			  go [address]\n"
+		"			  ram-go file [address]\n"
 		"	-u		Disable the flash write-protection\n"
 		"	-e n		Only erase n pages before writing the flash\n"
+		"	-a start:length	Only read, write, verify and erase the given address range\n"
+		"			(length defaults to the end of the memory area)\n"
 		"	-v		Verify writes\n"
+		"	-V		Verify the flash once the whole image is written, reading it\n"
+		"			back in 256 byte pieces and writing only the blocks that differ\n"
+		"	-T		Show counts and latency histograms of each bootloader command\n"
+		"			and phase when done, or on SIGUSR1 while running\n"
+		"	-t trace	Record every byte on the serial line with its time to trace,\n"
+		"			'make replay' builds stm8replay to play it back\n"
 		"	-n count	Retry failed writes up to count times (default 10)\n"
+		"	-x filename	Load file into RAM above the E/W routines and start it,\n"
+		"			binaries are loaded at the -a address\n"
 		"	-g address	Start execution at specified address (0 = flash start)\n"
+		"	-C container	Build a pre-framed container from the -w image and exit,\n"
+		"			writing a container sends its stored frames as they are.\n"
+		"			Binaries are placed at the -a address (default 0x8000)\n"
+		"	-K dir		Keep parsed Intel HEX and S-record images in dir as containers\n"
+		"			named by the file contents, an unchanged image is not parsed again\n"
+		"	-P table	Lay per unit data over the flash write holding its addresses,\n"
+		"			one 'address u8|u16|u32|hex|str value' per line. A value of @file\n"
+		"			is read from file, a counter there goes up by one after each\n"
+		"			unit and a list loses its first line\n"
+		"	-U dir		Keep a record of the flash contents of each device in dir, by\n"
+		"			its unique ID. A full write to a device with a record only\n"
+		"			writes the blocks that changed, with -v the others are\n"
+		"			checked on the device first\n"
+		"	-A manifest	Check the device against a manifest of 'start[:length] [crc]'\n"
+		"			lines, the CRC-16/CCITT of each region is computed on the\n"
+		"			device. Regions without a CRC are printed with the one found\n"
 		"	-f		Force binary parser\n"
+		"	-z		Leave erased blocks out of HEX and S-record read output\n"
 		"	-h		Show this help\n"
 		"	-d		Use DTR-Line for Reset (Arduino-Style ;) )\n"
 #ifdef LANTRONIX_CPM
@@ -518,12 +2445,35 @@ void show_help(char *name) {
 		"	Read flash to file:\n"
 		"		%s -r filename /dev/ttyS0\n"
 		"\n"
+		"	Write flash and data EEPROM with verify:\n"
+		"		%s -w firmware.hex -E calib.bin -v /dev/ttyS0\n"
+		"\n"
+		"	Write flash and enable the bootloader in one session:\n"
+		"		%s -w firmware.hex -o OPTBL=0x55 /dev/ttyS0\n"
+		"\n"
+		"	Read the used parts of the flash to Intel HEX:\n"
+		"		%s -r dump.hex -z /dev/ttyS0\n"
+		"\n"
+		"	Read 64 bytes of data EEPROM to file:\n"
+		"		%s -r filename -a 0x4000:64 /dev/ttyS0\n"
+		"\n"
+		"	Build a container once, then write it on each station:\n"
+		"		%s -w firmware.hex -C firmware.s8f\n"
+		"		%s -w firmware.s8f -v /dev/ttyS0\n"
+		"\n"
 		"	Start execution:\n"
 		"		%s -g 0x0 /dev/ttyS0\n",
 		name,
 		name,
 		name,
 		name,
+		name,
+		name,
+		name,
+		name,
+		name,
+		name,
+		name,
 		name
 	);
 }
@@ -0,0 +1,231 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  option byte handling
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "optbytes.h"
+
+/* unchanged bytes between two changes that are rewritten rather than starting a new WRITE */
+#define OPTBYTES_GAP	8
+
+typedef struct {
+	const char	*name;
+	uint8_t		offset;		/* offset from the start of the option area */
+	char		complement;	/* followed by its complement byte */
+	const char	*desc;
+} optbyte_desc_t;
+
+/* STM8S option bytes, see RM0016 "Option bytes" */
+static const optbyte_desc_t optbyte_desc[] = {
+	{"OPT0" , 0x00, 0, "ROP"      },
+	{"OPT1" , 0x01, 1, "UBC"      },
+	{"OPT2" , 0x03, 1, "AFR"      },
+	{"OPT3" , 0x05, 1, "WDG/HSI"  },
+	{"OPT4" , 0x07, 1, "CLK"      },
+	{"OPT5" , 0x09, 1, "HSECNT"   },
+	{"OPT6" , 0x0B, 1, "Reserved" },
+	{"OPT7" , 0x0D, 1, "WAITSTATE"},
+	{"OPTBL", 0x7E, 1, "BL"       },
+	{NULL}
+};
+
+extern FILE *fp_stderr;
+
+static const optbyte_desc_t *optbytes_find(const char *name, unsigned int offset) {
+	const optbyte_desc_t *d;
+
+	for (d = optbyte_desc; d->name; ++d)
+		if (name ? strcasecmp(d->name, name) == 0 : d->offset == offset)
+			return d;
+	return NULL;
+}
+
+static void optbytes_decode(const optbyte_desc_t *d, uint8_t v, char *str, size_t len) {
+	switch(d->offset) {
+		case 0x00:
+			snprintf(str, len, "read-out protection %s", v == 0xAA ? "on" : "off");
+			break;
+		case 0x01:
+			snprintf(str, len, "user boot code %s", v ? "enabled" : "disabled");
+			break;
+		case 0x05:
+			snprintf(str, len, "HSITRIM=%d LSI_EN=%d IWDG_HW=%d WWDG_HW=%d WWDG_HALT=%d",
+				(v >> 4) & 1, (v >> 3) & 1, (v >> 2) & 1, (v >> 1) & 1, v & 1);
+			break;
+		case 0x07:
+			snprintf(str, len, "EXTCLK=%d CKAWUSEL=%d PRSC=%d",
+				(v >> 3) & 1, (v >> 2) & 1, v & 3);
+			break;
+		case 0x0D:
+			snprintf(str, len, "%d wait state(s)", v & 1);
+			break;
+		case 0x7E:
+			snprintf(str, len, "bootloader %s", v == 0x55 ? "enabled" : "disabled");
+			break;
+		default:
+			snprintf(str, len, "0x%02x", v);
+			break;
+	}
+}
+
+char optbytes_read(const stm8_t *stm, optbytes_t *opt) {
+	opt->start = stm->dev->opt_start;
+	opt->len   = stm->dev->opt_end - stm->dev->opt_start + 1;
+	if (opt->len > OPTBYTES_MAX)
+		opt->len = OPTBYTES_MAX;
+
+	if (!stm8_read_memory(stm, opt->start, opt->current, opt->len))
+		return 0;
+
+	memcpy(opt->wanted, opt->current, opt->len);
+	return 1;
+}
+
+/*
+	apply "NAME=value" or "address=value", complement bytes are kept in
+	step: giving the complement byte of a pair sets the option byte too
+*/
+int optbytes_set(optbytes_t *opt, const char *assign) {
+	const optbyte_desc_t *d;
+	char		name[16];
+	const char	*eq = strchr(assign, '=');
+	char		*end;
+	unsigned long	offset, value;
+
+	if (!eq || eq == assign || (size_t)(eq - assign) >= sizeof(name))
+		return 1;
+	memcpy(name, assign, eq - assign);
+	name[eq - assign] = 0;
+
+	value = strtoul(eq + 1, &end, 0);
+	if (end == eq + 1 || *end || value > 0xFF)
+		return 1;
+
+	if ((d = optbytes_find(name, 0))) {
+		offset = d->offset;
+	} else {
+		offset = strtoul(name, &end, 0);
+		if (end == name || *end || offset < opt->start || offset - opt->start >= opt->len)
+			return 1;
+		offset -= opt->start;
+		d = optbytes_find(NULL, offset);
+	}
+
+	opt->wanted[offset] = value;
+	if (d && d->complement)
+		opt->wanted[offset + 1] = ~value;
+	else if (!d && offset && (d = optbytes_find(NULL, offset - 1)) && d->complement)
+		opt->wanted[offset - 1] = ~value;
+	return 0;
+}
+
+/* report option bytes whose complement does not match, returns the number of bad pairs */
+int optbytes_check(const optbytes_t *opt, FILE *fp) {
+	const optbyte_desc_t *d;
+	int bad = 0;
+
+	for (d = optbyte_desc; d->name; ++d) {
+		if (!d->complement || d->offset + 1u >= opt->len) continue;
+		if ((uint8_t)~opt->current[d->offset] != opt->current[d->offset + 1]) {
+			fprintf(fp, "Option byte %s at 0x%08x: complement mismatch (0x%02x/0x%02x)\n",
+				d->name, opt->start + d->offset,
+				opt->current[d->offset], opt->current[d->offset + 1]);
+			++bad;
+		}
+	}
+
+	return bad;
+}
+
+void optbytes_print(const optbytes_t *opt, FILE *fp) {
+	const optbyte_desc_t *d;
+	char str[64];
+
+	fprintf(fp, "Option bytes : 0x%08x-0x%08x\n", opt->start, opt->start + opt->len - 1);
+	for (d = optbyte_desc; d->name; ++d) {
+		if (d->offset >= opt->len) continue;
+
+		optbytes_decode(d, opt->current[d->offset], str, sizeof(str));
+		if (d->complement)
+			fprintf(fp, "  %-5s 0x%08x 0x%02x/0x%02x %-9s %s\n", d->name, opt->start + d->offset,
+				opt->current[d->offset], opt->current[d->offset + 1], d->desc, str);
+		else
+			fprintf(fp, "  %-5s 0x%08x 0x%02x      %-9s %s\n", d->name, opt->start + d->offset,
+				opt->current[d->offset], d->desc, str);
+	}
+}
+
+int optbytes_changed(const optbytes_t *opt) {
+	return memcmp(opt->current, opt->wanted, opt->len) != 0;
+}
+
+/*
+	write the changed option bytes, changes that are close together are
+	sent in one WRITE command together with the unchanged bytes in between
+*/
+char optbytes_write(const stm8_t *stm, optbytes_t *opt, char verify) {
+	const optbyte_desc_t *d;
+	unsigned int first, last, i;
+
+	/* a pair that is changed has to stay a pair, a broken one is an option byte error on the device */
+	for (d = optbyte_desc; d->name; ++d) {
+		if (!d->complement || d->offset + 1u >= opt->len) continue;
+		if (memcmp(&opt->wanted[d->offset], &opt->current[d->offset], 2) != 0 &&
+		    (uint8_t)~opt->wanted[d->offset] != opt->wanted[d->offset + 1]) {
+			fprintf(fp_stderr, "Not writing option byte %s at 0x%08x: 0x%02x/0x%02x is no complement pair\n",
+				d->name, opt->start + d->offset, opt->wanted[d->offset], opt->wanted[d->offset + 1]);
+			return 0;
+		}
+	}
+
+	for (first = 0; first < opt->len; first = last + 1) {
+		while (first < opt->len && opt->wanted[first] == opt->current[first]) ++first;
+		if (first == opt->len) break;
+
+		for (last = i = first; i < opt->len && i - last <= OPTBYTES_GAP; ++i)
+			if (opt->wanted[i] != opt->current[i])
+				last = i;
+
+		if (!stm8_write_memory(stm, opt->start + first, &opt->wanted[first], last - first + 1)) {
+			fprintf(fp_stderr, "Failed to write option bytes at address 0x%08x\n", opt->start + first);
+			return 0;
+		}
+	}
+
+	if (!verify) {
+		memcpy(opt->current, opt->wanted, opt->len);
+		return 1;
+	}
+
+	if (!stm8_read_memory(stm, opt->start, opt->current, opt->len)) {
+		fprintf(fp_stderr, "Failed to read option bytes at address 0x%08x\n", opt->start);
+		return 0;
+	}
+
+	for (i = 0; i < opt->len; ++i)
+		if (opt->current[i] != opt->wanted[i]) {
+			fprintf(fp_stderr, "Failed to verify option byte at address 0x%08x, expected 0x%02x and found 0x%02x\n",
+				opt->start + i, opt->wanted[i], opt->current[i]);
+			return 0;
+		}
+
+	return 1;
+}
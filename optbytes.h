@@ -0,0 +1,46 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  option byte handling
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _OPTBYTES_H
+#define _OPTBYTES_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "stm8.h"
+
+#define OPTBYTES_MAX	128
+
+typedef struct optbytes optbytes_t;
+
+struct optbytes {
+	uint32_t	start;				/* address of the first option byte */
+	unsigned int	len;				/* size of the option area */
+	uint8_t		current[OPTBYTES_MAX];		/* contents read from the device */
+	uint8_t		wanted [OPTBYTES_MAX];		/* contents to be written */
+};
+
+char optbytes_read  (const stm8_t *stm, optbytes_t *opt);
+int  optbytes_set   (optbytes_t *opt, const char *assign);
+int  optbytes_check (const optbytes_t *opt, FILE *fp);
+void optbytes_print (const optbytes_t *opt, FILE *fp);
+int  optbytes_changed(const optbytes_t *opt);
+char optbytes_write (const stm8_t *stm, optbytes_t *opt, char verify);
+
+#endif
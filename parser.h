@@ -21,9 +21,20 @@
 #ifndef _H_PARSER
 #define _H_PARSER
 
+#include <stdint.h>
+#include <string.h>
+
 typedef struct parser     parser_t;
+typedef struct parser_seg parser_seg_t;
 typedef enum   parser_err parser_err_t;
 
+/* a contiguous run of image data at its load address */
+struct parser_seg {
+	uint32_t	address;
+	unsigned int	len;
+	const uint8_t	*data;		/* owned by the parser, valid until close */
+};
+
 struct parser {
 	const char *name;
 	void*        (*init )();							/* initialise the parser */
@@ -31,7 +42,9 @@ struct parser {
 	parser_err_t (*close)(void *storage);						/* close and free the parser */
 	unsigned int (*size )(void *storage);						/* get the total data size */
 	parser_err_t (*read )(void *storage, void *data, unsigned int *len);		/* read a block of data */
-	parser_err_t (*write)(void *storage, void *data, unsigned int len);		/* write a block of data */
+	parser_err_t (*write)(void *storage, uint32_t address, void *data, unsigned int len);	/* write a block of data to address */
+	parser_err_t (*segment)(void *storage, unsigned int index, parser_seg_t *seg);	/* get a segment, sorted by address (optional) */
+	parser_err_t (*view )(void *storage, unsigned int offset, const uint8_t **data, unsigned int *len);	/* point at up to len bytes of the image at offset, without copying (optional) */
 };
 
 enum parser_err {
@@ -39,9 +52,135 @@ enum parser_err {
 	PARSER_ERR_SYSTEM,
 	PARSER_ERR_INVALID_FILE,
 	PARSER_ERR_WRONLY,
-	PARSER_ERR_RDONLY
+	PARSER_ERR_RDONLY,
+	PARSER_ERR_END,
+	PARSER_ERR_DAMAGED
+};
+
+/*
+	walk the image of any parser as segments in address order, a raw image
+	without addresses of its own is a single segment placed at base
+*/
+typedef struct parser_iter parser_iter_t;
+struct parser_iter {
+	parser_t	*parser;
+	void		*storage;
+	uint32_t	base;
+	unsigned int	index;
+};
+
+static inline void parser_iter_init(parser_iter_t *it, parser_t *parser, void *storage, uint32_t base) {
+	it->parser	= parser;
+	it->storage	= storage;
+	it->base	= base;
+	it->index	= 0;
+}
+
+/* get the next segment, PARSER_ERR_END after the last one */
+static inline parser_err_t parser_next(parser_iter_t *it, parser_seg_t *seg) {
+	parser_err_t	err;
+	unsigned int	len;
+
+	if (it->parser->segment)
+		return it->parser->segment(it->storage, it->index++, seg);
+
+	if (it->index++ || !it->parser->view)
+		return PARSER_ERR_END;
+
+	len = it->parser->size(it->storage);
+	if ((err = it->parser->view(it->storage, 0, &seg->data, &len)) != PARSER_ERR_OK)
+		return err;
+	seg->address	= it->base;
+	seg->len	= len;
+	return PARSER_ERR_OK;
+}
+
+/*
+	walk the image as the flash blocks it has data in, limited to [start,
+	end). A block covers its data from the first to the last byte, the
+	data of a block within one segment is the parser's own memory, several
+	segments are gathered into buf with zero in the gaps between them
+*/
+#define PARSER_BLOCK	128
+
+typedef struct parser_blocks parser_blocks_t;
+typedef struct parser_block  parser_block_t;
+
+struct parser_blocks {
+	parser_iter_t	it;		/* the first segment not behind pos */
+	uint32_t	pos;		/* the image before it is done */
+	uint32_t	end;
 };
 
+struct parser_block {
+	uint32_t	address;	/* of the block, a multiple of PARSER_BLOCK */
+	unsigned int	first, last;	/* the data runs from address + first up to address + last */
+	unsigned int	bytes;		/* of image data, the gaps left out */
+	unsigned int	pieces;		/* segments the data comes from */
+	const uint8_t	*data;		/* the bytes from first to last */
+	uint8_t		buf[PARSER_BLOCK];
+};
+
+static inline void parser_blocks_init(parser_blocks_t *b, parser_t *parser, void *storage, uint32_t base, uint32_t start, uint32_t end) {
+	parser_iter_init(&b->it, parser, storage, base);
+	b->pos	= start;
+	b->end	= end;
+}
+
+/* get the next block, PARSER_ERR_END after the last one */
+static inline parser_err_t parser_next_block(parser_blocks_t *b, parser_block_t *blk) {
+	parser_iter_t	look;
+	parser_seg_t	seg, s;
+	uint32_t	start = b->pos, from, to;
+
+	for (look = b->it; parser_next(&look, &seg) == PARSER_ERR_OK; ) {
+		if (seg.address + seg.len <= b->pos) {
+			b->it = look;
+			continue;
+		}
+
+		from = seg.address > b->pos ? seg.address : b->pos;
+		if (from >= b->end) break;
+		blk->address = from - from % PARSER_BLOCK;
+		b->pos       = blk->address + PARSER_BLOCK;
+
+		/* every segment touching this block */
+		blk->first  = PARSER_BLOCK;
+		blk->last   = 0;
+		blk->bytes  = 0;
+		blk->pieces = 0;
+		for (look = b->it; parser_next(&look, &s) == PARSER_ERR_OK && s.address < b->pos; ) {
+			from = s.address > blk->address ? s.address : blk->address;
+			from = from      > start        ? from      : start;
+			to   = s.address + s.len < b->pos ? s.address + s.len : b->pos;
+			to   = to                < b->end ? to                : b->end;
+			if (from >= to) continue;
+
+			if (blk->pieces == 0)
+				blk->data = &s.data[from - s.address];
+			else {
+				if (blk->pieces == 1) {
+					memset(blk->buf, 0, sizeof(blk->buf));
+					memcpy(&blk->buf[blk->first], blk->data, blk->last - blk->first);
+				}
+				memcpy(&blk->buf[from - blk->address], &s.data[from - s.address], to - from);
+			}
+			++blk->pieces;
+
+			if (from - blk->address < blk->first) blk->first = from - blk->address;
+			if (to   - blk->address > blk->last ) blk->last  = to   - blk->address;
+			blk->bytes += to - from;
+		}
+		if (blk->pieces == 0) {
+			look = b->it;
+			continue;
+		}
+		if (blk->pieces > 1) blk->data = &blk->buf[blk->first];
+		return PARSER_ERR_OK;
+	}
+	return PARSER_ERR_END;
+}
+
 static inline const char* parser_errstr(parser_err_t err) {
 	switch(err) {
 		case PARSER_ERR_OK          : return "OK";
@@ -49,6 +188,8 @@ static inline const char* parser_errstr(parser_err_t err) {
 		case PARSER_ERR_INVALID_FILE: return "Invalid File";
 		case PARSER_ERR_WRONLY      : return "Parser can only write";
 		case PARSER_ERR_RDONLY      : return "Parser can only read";
+		case PARSER_ERR_END         : return "No more data";
+		case PARSER_ERR_DAMAGED     : return "File is damaged";
 		default:
 			return "Unknown Error";
 	}
@@ -23,13 +23,24 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#ifndef __WIN32__
+#include <sys/mman.h>
+#endif
 
 #include "binary.h"
 
+/* output is collected and written in chunks of this size */
+#define BINARY_OUT_SIZE	65536
+
 typedef struct {
 	int		fd;
 	char		write;
 	struct stat	stat;
+	uint8_t		*map;		/* the whole file when reading */
+	size_t		pos;		/* read position */
+	uint8_t		*out;		/* data waiting to be written */
+	size_t		out_used;
 } binary_t;
 
 void* binary_init() {
@@ -39,32 +50,77 @@ void* binary_init() {
 parser_err_t binary_open(void *storage, const char *filename, const char write) {
 	binary_t *st = storage;
 	if (write) {
-		st->fd = open(
-			filename,
-			O_WRONLY | O_CREAT | O_TRUNC,
+		/* "-" is the standard output, for piping a dump on */
+		if (strcmp(filename, "-") == 0)
+			st->fd = dup(STDOUT_FILENO);
+		else
+			st->fd = open(
+				filename,
+				O_WRONLY | O_CREAT | O_TRUNC,
 #ifndef __WIN32__
-			S_IRUSR  | S_IWUSR | S_IRGRP | S_IROTH
+				S_IRUSR  | S_IWUSR | S_IRGRP | S_IROTH
 #else
-			0
+				0
 #endif
-		);
+			);
 		st->stat.st_size = 0;
+		if (st->fd != -1 && !(st->out = malloc(BINARY_OUT_SIZE)))
+			return PARSER_ERR_SYSTEM;
 	} else {
 		if (stat(filename, &st->stat) != 0)
 			return PARSER_ERR_INVALID_FILE;
 		st->fd = open(filename, O_RDONLY);
+		if (st->fd != -1 && st->stat.st_size > 0) {
+			/* reads and views come straight from the mapping */
+#ifndef __WIN32__
+			st->map = mmap(NULL, st->stat.st_size, PROT_READ, MAP_PRIVATE, st->fd, 0);
+			if (st->map == MAP_FAILED) {
+				st->map = NULL;
+				return PARSER_ERR_SYSTEM;
+			}
+#else
+			if (!(st->map = malloc(st->stat.st_size)) ||
+			    read(st->fd, st->map, st->stat.st_size) != st->stat.st_size)
+				return PARSER_ERR_SYSTEM;
+#endif
+		}
 	}
 
 	st->write = write;
 	return st->fd == -1 ? PARSER_ERR_SYSTEM : PARSER_ERR_OK;
 }
 
+static parser_err_t binary_flush(binary_t *st) {
+	uint8_t	*p = st->out;
+	ssize_t	r;
+
+	while (st->out_used > 0) {
+		r = write(st->fd, p, st->out_used);
+		if (r < 1) return PARSER_ERR_SYSTEM;
+		st->out_used -= r;
+		p            += r;
+	}
+	return PARSER_ERR_OK;
+}
+
 parser_err_t binary_close(void *storage) {
 	binary_t *st = storage;
+	parser_err_t err = PARSER_ERR_OK;
 
+	if (st->out) {
+		err = binary_flush(st);
+		free(st->out);
+	}
+	if (st->map) {
+#ifndef __WIN32__
+		munmap(st->map, st->stat.st_size);
+#else
+		free(st->map);
+#endif
+	}
 	if (st->fd) close(st->fd);
 	free(st);
-	return PARSER_ERR_OK;
+	return err;
 }
 
 unsigned int binary_size(void *storage) {
@@ -74,38 +130,49 @@ unsigned int binary_size(void *storage) {
 
 parser_err_t binary_read(void *storage, void *data, unsigned int *len) {
 	binary_t *st = storage;
-	unsigned int left = *len;
 	if (st->write) return PARSER_ERR_WRONLY;
 
-	ssize_t r;
-	while(left > 0) {
-		r = read(st->fd, data, left);
-		if (r < 0) return PARSER_ERR_SYSTEM;
-		left -= r;
-		data += r;
-	}
-
-	*len = *len - left;
+	if (*len > st->stat.st_size - st->pos)
+		*len = st->stat.st_size - st->pos;
+	memcpy(data, st->map + st->pos, *len);
+	st->pos += *len;
 	return PARSER_ERR_OK;
 }
 
-parser_err_t binary_write(void *storage, void *data, unsigned int len) {
+/* the data is written in call order, a raw image has no place for the address */
+parser_err_t binary_write(void *storage, uint32_t address, void *data, unsigned int len) {
 	binary_t *st = storage;
 	if (!st->write) return PARSER_ERR_RDONLY;
 
-	ssize_t r;
+	size_t n;
 	while(len > 0) {
-		r = write(st->fd, data, len);
-		if (r < 1) return PARSER_ERR_SYSTEM;
-		st->stat.st_size += r;
+		if (st->out_used == BINARY_OUT_SIZE && binary_flush(st) != PARSER_ERR_OK)
+			return PARSER_ERR_SYSTEM;
 
-		len  -= r;
-		data += r;
+		n = BINARY_OUT_SIZE - st->out_used;
+		n = n > len ? len : n;
+		memcpy(st->out + st->out_used, data, n);
+		st->out_used     += n;
+		st->stat.st_size += n;
+
+		len  -= n;
+		data += n;
 	}
 
 	return PARSER_ERR_OK;
 }
 
+parser_err_t binary_view(void *storage, unsigned int offset, const uint8_t **data, unsigned int *len) {
+	binary_t *st = storage;
+	if (st->write) return PARSER_ERR_WRONLY;
+	if (offset >= st->stat.st_size) return PARSER_ERR_END;
+
+	*data = st->map + offset;
+	if (*len > st->stat.st_size - offset)
+		*len = st->stat.st_size - offset;
+	return PARSER_ERR_OK;
+}
+
 parser_t PARSER_BINARY = {
 	"Raw BINARY",
 	binary_init,
@@ -113,6 +180,8 @@ parser_t PARSER_BINARY = {
 	binary_close,
 	binary_size,
 	binary_read,
-	binary_write
+	binary_write,
+	NULL,
+	binary_view
 };
 
@@ -0,0 +1,232 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  ELF program header loader
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifndef __WIN32__
+#include <sys/mman.h>
+#endif
+
+#include "elf.h"
+#include "image.h"
+
+/*
+	the file is mapped and the PT_LOAD segments are handed out as pointers
+	into the mapping, the image arena is the mapping itself and a segment
+	offset is its file offset
+*/
+typedef struct {
+	image_t		img;
+	uint8_t		*map;
+	size_t		map_len;
+} elf_t;
+
+/* the few ELF constants needed, see the System V ABI */
+#define ELF_CLASS32	1
+#define ELF_CLASS64	2
+#define ELF_DATA2LSB	1
+#define ELF_DATA2MSB	2
+#define ELF_PT_LOAD	1
+
+static uint32_t elf_get(const uint8_t *p, int len, char msb) {
+	uint32_t v = 0;
+	int i;
+
+	for (i = 0; i < len; ++i)
+		v |= (uint32_t)p[i] << 8 * (msb ? len - 1 - i : i);
+	return v;
+}
+
+/* read an address or offset, 64 bit values have to fit in 32 bits */
+static int elf_word(const uint8_t *p, char is64, char msb, uint32_t *v) {
+	if (is64 && elf_get(p + (msb ? 0 : 4), 4, msb) != 0)
+		return 0;
+
+	*v = elf_get(p + (is64 && msb ? 4 : 0), 4, msb);
+	return 1;
+}
+
+static int elf_seg_cmp(const void *a, const void *b) {
+	const image_seg_t *x = a, *y = b;
+	return x->address < y->address ? -1 : x->address > y->address;
+}
+
+void* elf_init() {
+	elf_t *st = calloc(sizeof(elf_t), 1);
+	if (st) st->img.fd = -1;
+	return st;
+}
+
+parser_err_t elf_open(void *storage, const char *filename, const char write) {
+	elf_t		*st = storage;
+	const uint8_t	*ph;
+	char		is64, msb;
+	uint32_t	phoff, phentsize, phnum, i;
+	uint32_t	offset, paddr, filesz;
+	image_seg_t	*seg;
+
+	if (write)
+		return PARSER_ERR_RDONLY;
+
+#ifndef __WIN32__
+	{
+		struct stat	sb;
+		int		fd = open(filename, O_RDONLY);
+
+		if (fd < 0)
+			return PARSER_ERR_SYSTEM;
+		if (fstat(fd, &sb) != 0) {
+			close(fd);
+			return PARSER_ERR_SYSTEM;
+		}
+		/* too short for an ELF header, and nothing to map */
+		if (sb.st_size < 52) {
+			char	magic[4];
+			int	elf = read(fd, magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, "\177ELF", 4) == 0;
+
+			close(fd);
+			return elf ? PARSER_ERR_DAMAGED : PARSER_ERR_INVALID_FILE;
+		}
+
+		st->map_len = sb.st_size;
+		st->map     = mmap(NULL, st->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (st->map == MAP_FAILED) {
+			st->map = NULL;
+			return PARSER_ERR_SYSTEM;
+		}
+	}
+#else
+	if (!(st->map = image_load(filename, &st->map_len)))
+		return PARSER_ERR_SYSTEM;
+#endif
+
+	if (st->map_len < 4 || memcmp(st->map, "\177ELF", 4) != 0)
+		return PARSER_ERR_INVALID_FILE;
+
+	/* from here on it is an ELF file, a bad one must not be written as a binary */
+	if (st->map_len < 52)
+		return PARSER_ERR_DAMAGED;
+
+	is64 = st->map[4] == ELF_CLASS64;
+	msb  = st->map[5] == ELF_DATA2MSB;
+	if ((st->map[4] != ELF_CLASS32 && !is64) || (st->map[5] != ELF_DATA2LSB && !msb))
+		return PARSER_ERR_DAMAGED;
+
+	/* 64 bit files are accepted as long as everything fits in 32 bits */
+	if ((is64 && st->map_len < 64) || !elf_word(st->map + (is64 ? 32 : 28), is64, msb, &phoff))
+		return PARSER_ERR_DAMAGED;
+	phentsize = elf_get(st->map + (is64 ? 54 : 42), 2, msb);
+	phnum     = elf_get(st->map + (is64 ? 56 : 44), 2, msb);
+
+	if (phentsize < (is64 ? 56u : 32u) || phoff > st->map_len || phnum > (st->map_len - phoff) / phentsize)
+		return PARSER_ERR_DAMAGED;
+
+	if (phnum && !(st->img.seg = malloc(phnum * sizeof(image_seg_t))))
+		return PARSER_ERR_SYSTEM;
+
+	/* the loadable segments with data in the file, at their physical address */
+	for (i = 0; i < phnum; ++i) {
+		ph = st->map + phoff + i * phentsize;
+		if (elf_get(ph, 4, msb) != ELF_PT_LOAD)
+			continue;
+
+		if (!elf_word(ph + (is64 ?  8 :  4), is64, msb, &offset) ||
+		    !elf_word(ph + (is64 ? 24 : 12), is64, msb, &paddr ) ||
+		    !elf_word(ph + (is64 ? 32 : 16), is64, msb, &filesz))
+			return PARSER_ERR_DAMAGED;
+
+		if (filesz == 0)
+			continue;
+		if (offset > st->map_len || filesz > st->map_len - offset)
+			return PARSER_ERR_DAMAGED;
+
+		seg = &st->img.seg[st->img.nseg++];
+		seg->address	= paddr;
+		seg->len	= filesz;
+		seg->offset	= offset;
+	}
+
+	qsort(st->img.seg, st->img.nseg, sizeof(image_seg_t), elf_seg_cmp);
+	for (i = 1; i < st->img.nseg; ++i)
+		if (st->img.seg[i].address < st->img.seg[i - 1].address + st->img.seg[i - 1].len)
+			return PARSER_ERR_DAMAGED;
+
+	st->img.data = st->map;
+	return PARSER_ERR_OK;
+}
+
+parser_err_t elf_close(void *storage) {
+	elf_t *st = storage;
+
+	if (st) {
+		/* the arena is the mapping, it is not freed with the image */
+		st->img.data = NULL;
+		image_close(&st->img);
+#ifndef __WIN32__
+		if (st->map) munmap(st->map, st->map_len);
+#else
+		free(st->map);
+#endif
+	}
+	free(st);
+	return PARSER_ERR_OK;
+}
+
+unsigned int elf_size(void *storage) {
+	elf_t *st = storage;
+	return image_size(&st->img);
+}
+
+parser_err_t elf_read(void *storage, void *data, unsigned int *len) {
+	elf_t *st = storage;
+	return image_read(&st->img, data, len);
+}
+
+parser_err_t elf_write(void *storage, uint32_t address, void *data, unsigned int len) {
+	return PARSER_ERR_RDONLY;
+}
+
+parser_err_t elf_segment(void *storage, unsigned int index, parser_seg_t *seg) {
+	elf_t *st = storage;
+	return image_segment(&st->img, index, seg);
+}
+
+parser_err_t elf_view(void *storage, unsigned int offset, const uint8_t **data, unsigned int *len) {
+	elf_t *st = storage;
+	return image_view(&st->img, offset, data, len);
+}
+
+parser_t PARSER_ELF = {
+	"ELF",
+	elf_init,
+	elf_open,
+	elf_close,
+	elf_size,
+	elf_read,
+	elf_write,
+	elf_segment,
+	elf_view
+};
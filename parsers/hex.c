@@ -18,194 +18,227 @@
 */
 
 
-#include <sys/types.h>
-#include <fcntl.h>
-#include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "hex.h"
+#include "image.h"
 #include "utils.h"
 
 typedef struct {
-	size_t		data_len, offset;
-	uint8_t		*data;
-	uint8_t		base;
+	image_t		img;
+	char		write;
+	uint32_t	ela;		/* last extended linear address written */
 } hex_t;
 
+/* data bytes per record, records never cross a multiple of this */
+#define HEX_REC_SIZE	16
+
 void* hex_init() {
-	return calloc(sizeof(hex_t), 1);
+	hex_t *st;
+
+	image_init_digits();
+	if ((st = calloc(sizeof(hex_t), 1)))
+		st->img.fd = -1;
+	return st;
 }
 
 parser_err_t hex_open(void *storage, const char *filename, const char write) {
-	hex_t *st = storage;
+	hex_t		*st = storage;
+	uint8_t		*buf, *p, *end;
+	uint8_t		*raw;
+	uint8_t		*record;
+	image_seg_t	*rec;
+	unsigned int	nrec = 0;
+	uint8_t		checksum;
+	size_t		len, used = 0;
+	uint32_t	base = 0;
+	int		reclen, address, type, c, i;
+	parser_err_t	err = PARSER_ERR_INVALID_FILE;
+
 	if (write) {
-		return PARSER_ERR_RDONLY;
-	} else {
-		char mark;
-		int i, fd;
-		uint8_t checksum;
-		unsigned int c;
-		uint32_t base = 0;
-		unsigned int last_address = 0x0;
-
-		fd = open(filename, O_RDONLY);
-		if (fd < 0)
+		if (image_create(&st->img, filename) != PARSER_ERR_OK)
 			return PARSER_ERR_SYSTEM;
 
-		/* read in the file */
-
-		while(read(fd, &mark, 1) != 0) {
-			if (mark == '\n' || mark == '\r') continue;
-			if (mark != ':')
-				return PARSER_ERR_INVALID_FILE;
-
-			char buffer[9];
-			unsigned int reclen, address, type;
-			uint8_t *record;
-
-			/* get the reclen, address, and type */
-			buffer[8] = 0;
-			if (read(fd, &buffer, 8) != 8) return PARSER_ERR_INVALID_FILE;
-			if (sscanf(buffer, "%2x%4x%2x", &reclen, &address, &type) != 3) {
-				close(fd);
-				return PARSER_ERR_INVALID_FILE;
-			}
-
-			/* setup the checksum */
-			checksum =
-				reclen +
-				((address & 0xFF00) >> 8) +
-				((address & 0x00FF) >> 0) +
-				type;
-
-			switch(type) {
-				/* data record */
-				case 0:
-					c = address - last_address;
-					st->data = realloc(st->data, st->data_len + c + reclen);
-
-					/* if there is a gap, set it to 0xff and increment the length */
-					if (c > 0) {
-						memset(&st->data[st->data_len], 0xff, c);
-						st->data_len += c;
-					}
-
-					last_address = address + reclen;
-					record = &st->data[st->data_len];
-					st->data_len += reclen;
-					break;
-
-				/* extended segment address record */
-				case 2:
-					base = 0;
-					break;
-
-				/* extended linear address record */
-				case 4:
-					base = address;
-					break;
-			}
-
-			buffer[2] = 0;
-			for(i = 0; i < reclen; ++i) {
-				if (read(fd, &buffer, 2) != 2 || sscanf(buffer, "%2x", &c) != 1) {
-					close(fd);
-					return PARSER_ERR_INVALID_FILE;
-				}
-
-				/* add the byte to the checksum */
-				checksum += c;
-
-				switch(type) {
-					case 0:
-						record[i] = c;
-						break;
-
-					case 2:
-					case 4:
-						base = (base << 8) | c;
-						break;
-				}
-			}
-
-			/* read, scan, and verify the checksum */
-			if (
-				read(fd, &buffer, 2 ) != 2 ||
-				sscanf(buffer, "%2x", &c) != 1 ||
-				(uint8_t)(checksum + c) != 0x00
-			) {
-				close(fd);
-				return PARSER_ERR_INVALID_FILE;
-			}
-
-			switch(type) {
-				/* EOF */
-				case 1:
-					close(fd);
-					return PARSER_ERR_OK;
-
-				/* address record */
-				case 2: base = base << 4;
-				case 4:	base = be_u32(base);
-					/* Reset last_address since our base changed */
-					last_address = 0;
-
-					if (st->base == 0) {
-						st->base = base;
-						break;
-					}
-
-					/* we cant cope with files out of order */
-					if (base < st->base) {
-						close(fd);
-						return PARSER_ERR_INVALID_FILE;
-					}
-
-					/* if there is a gap, enlarge and fill with zeros */
-					unsigned int len = base - st->base;
-					if (len > st->data_len) {
-						st->data = realloc(st->data, len);
-						memset(&st->data[st->data_len], 0, len - st->data_len);
-						st->data_len = len;
-					}
-					break;
-			}
+		st->write = 1;
+		st->ela   = 0xffffffff;
+		return PARSER_ERR_OK;
+	}
+
+	if (!(buf = image_load(filename, &len)))
+		return PARSER_ERR_SYSTEM;
+
+	/* a record takes at least 11 characters and two per data byte, so these never grow */
+	raw = malloc(len / 2 + 1);
+	rec = malloc((len / 11 + 1) * sizeof(image_seg_t));
+	if (!raw || !rec) {
+		err = PARSER_ERR_SYSTEM;
+		goto out;
+	}
+
+	p   = buf;
+	end = buf + len;
+	while (p < end) {
+		if (*p == '\n' || *p == '\r') {
+			++p;
+			continue;
 		}
 
-		close(fd);
-		return PARSER_ERR_OK;
+		/* mark, reclen, address, type and checksum take 11 characters */
+		if (*p != ':' || end - p < 11)
+			goto out;
+
+		reclen	= image_hex_byte(p + 1);
+		address	= image_hex_byte(p + 3) << 8 | image_hex_byte(p + 5);
+		type	= image_hex_byte(p + 7);
+		if (reclen < 0 || address < 0 || type < 0 || end - p < 11 + 2 * reclen)
+			goto out;
+
+		/* decode the data and build the checksum in one pass */
+		record   = &raw[used];
+		checksum = reclen + (address >> 8) + address + type;
+		for (i = 0; i < reclen; ++i) {
+			if ((c = image_hex_byte(p + 9 + 2 * i)) < 0)
+				goto out;
+			record[i]  = c;
+			checksum  += c;
+		}
+
+		if ((c = image_hex_byte(p + 9 + 2 * reclen)) < 0 || (uint8_t)(checksum + c) != 0x00)
+			goto out;
+		p += 11 + 2 * reclen;
+
+		switch(type) {
+			/* data record */
+			case 0:
+				rec[nrec].address	= base + address;
+				rec[nrec].len		= reclen;
+				rec[nrec].offset	= used;
+				used += reclen;
+				++nrec;
+				break;
+
+			/* EOF */
+			case 1:
+				goto done;
+
+			/* extended segment address record */
+			case 2:
+			/* extended linear address record */
+			case 4:
+				if (reclen != 2)
+					goto out;
+				base = (record[0] << 8 | record[1]) << (type == 2 ? 4 : 16);
+				break;
+		}
+	}
+
+done:
+	err = image_merge(&st->img, raw, rec, nrec);
+out:
+	free(rec);
+	free(raw);
+	free(buf);
+	return err;
+}
+
+/* format one record into the output buffer */
+static parser_err_t hex_record(hex_t *st, uint8_t type, uint16_t address, const uint8_t *data, uint8_t len) {
+	uint8_t		*p;
+	uint8_t		checksum;
+	unsigned int	i;
+
+	/* ':', length, address, type, data, checksum and newline */
+	if (!(p = image_reserve(&st->img, 12 + 2 * len)))
+		return PARSER_ERR_SYSTEM;
+
+	*p++ = ':';
+	p = image_put_byte(p, len);
+	p = image_put_byte(p, address >> 8);
+	p = image_put_byte(p, address);
+	p = image_put_byte(p, type);
+	checksum = len + (address >> 8) + address + type;
+	for (i = 0; i < len; ++i) {
+		p = image_put_byte(p, data[i]);
+		checksum += data[i];
 	}
+	p = image_put_byte(p, -checksum);
+	*p++ = '\n';
+
+	st->img.out_used = p - st->img.out;
+	return PARSER_ERR_OK;
 }
 
 parser_err_t hex_close(void *storage) {
 	hex_t *st = storage;
-	if (st) free(st->data);
+	parser_err_t err = PARSER_ERR_OK;
+
+	if (st) {
+		/* EOF record */
+		if (st->write && hex_record(st, 1, 0, NULL, 0) != PARSER_ERR_OK)
+			err = PARSER_ERR_SYSTEM;
+		if (image_close(&st->img) != PARSER_ERR_OK)
+			err = PARSER_ERR_SYSTEM;
+	}
 	free(st);
-	return PARSER_ERR_OK;
+	return err;
 }
 
 unsigned int hex_size(void *storage) {
 	hex_t *st = storage;
-	return st->data_len;
+	return image_size(&st->img);
 }
 
 parser_err_t hex_read(void *storage, void *data, unsigned int *len) {
 	hex_t *st = storage;
-	unsigned int left = st->data_len - st->offset;
-	unsigned int get  = left > *len ? *len : left;
+	if (st->write) return PARSER_ERR_WRONLY;
+	return image_read(&st->img, data, len);
+}
 
-	memcpy(data, &st->data[st->offset], get);
-	st->offset += get;
+parser_err_t hex_segment(void *storage, unsigned int index, parser_seg_t *seg) {
+	hex_t *st = storage;
+	return image_segment(&st->img, index, seg);
+}
+
+/*
+	add data at address to the output, an extended linear address record is
+	written whenever the upper 16 bits change, so blocks may be skipped
+*/
+parser_err_t hex_write(void *storage, uint32_t address, void *data, unsigned int len) {
+	hex_t		*st = storage;
+	uint8_t		*pos = data;
+	uint8_t		ela[2];
+	unsigned int	n;
+
+	if (!st->write) return PARSER_ERR_RDONLY;
+
+	while (len > 0) {
+		if (address >> 16 != st->ela) {
+			st->ela = address >> 16;
+			ela[0]  = st->ela >> 8;
+			ela[1]  = st->ela;
+			if (hex_record(st, 4, 0, ela, 2) != PARSER_ERR_OK)
+				return PARSER_ERR_SYSTEM;
+		}
+
+		n = HEX_REC_SIZE - address % HEX_REC_SIZE;
+		n = n > len ? len : n;
+		if (hex_record(st, 0, address & 0xffff, pos, n) != PARSER_ERR_OK)
+			return PARSER_ERR_SYSTEM;
+
+		address += n;
+		pos     += n;
+		len     -= n;
+	}
 
-	*len = get;
 	return PARSER_ERR_OK;
 }
 
-parser_err_t hex_write(void *storage, void *data, unsigned int len) {
-	return PARSER_ERR_RDONLY;
+parser_err_t hex_view(void *storage, unsigned int offset, const uint8_t **data, unsigned int *len) {
+	hex_t *st = storage;
+	return image_view(&st->img, offset, data, len);
 }
 
 parser_t PARSER_HEX = {
@@ -215,6 +248,8 @@ parser_t PARSER_HEX = {
 	hex_close,
 	hex_size,
 	hex_read,
-	hex_write
+	hex_write,
+	hex_segment,
+	hex_view
 };
 
@@ -0,0 +1,286 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  segment image shared by the text image parsers
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+int8_t image_digit[256];
+const char image_hexchar[16] = "0123456789ABCDEF";
+
+void image_init_digits() {
+	int i;
+
+	if (image_digit[0]) return;
+
+	memset(image_digit, -1, sizeof(image_digit));
+	for (i = 0; i < 10; ++i) image_digit['0' + i] = i;
+	for (i = 0; i < 6; ++i) image_digit['A' + i] = image_digit['a' + i] = 10 + i;
+}
+
+/* read the whole file with as few read() calls as possible */
+uint8_t *image_load(const char *filename, size_t *len) {
+	struct stat	st;
+	uint8_t		*buf;
+	ssize_t		r;
+	size_t		got = 0;
+	int		fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || !(buf = malloc(st.st_size + 1))) {
+		close(fd);
+		return NULL;
+	}
+
+	while (got < (size_t)st.st_size) {
+		r = read(fd, buf + got, st.st_size - got);
+		if (r <= 0) break;
+		got += r;
+	}
+	close(fd);
+
+	*len = got;
+	return buf;
+}
+
+static int image_seg_cmp(const void *a, const void *b) {
+	const image_seg_t *x = a, *y = b;
+	return x->address < y->address ? -1 : x->address > y->address;
+}
+
+/*
+	sort the data records by address and merge them into segments, the
+	data is then copied in file order so later records win where they overlap
+*/
+parser_err_t image_merge(image_t *img, const uint8_t *raw, const image_seg_t *rec, unsigned int nrec) {
+	image_seg_t	*sorted, *seg;
+	unsigned int	i, lo, hi;
+	size_t		total = 0;
+
+	if (nrec == 0)
+		return PARSER_ERR_OK;
+
+	sorted   = malloc(nrec * sizeof(image_seg_t));
+	img->seg = malloc(nrec * sizeof(image_seg_t));
+	if (!sorted || !img->seg) {
+		free(sorted);
+		return PARSER_ERR_SYSTEM;
+	}
+	memcpy(sorted, rec, nrec * sizeof(image_seg_t));
+	qsort(sorted, nrec, sizeof(image_seg_t), image_seg_cmp);
+
+	for (i = 0; i < nrec; ++i) {
+		if (img->nseg) {
+			/* extend the last segment if the record touches it */
+			seg = &img->seg[img->nseg - 1];
+			if (sorted[i].address <= seg->address + seg->len) {
+				if (sorted[i].address + sorted[i].len > seg->address + seg->len)
+					seg->len = sorted[i].address + sorted[i].len - seg->address;
+				continue;
+			}
+		}
+		img->seg[img->nseg++] = sorted[i];
+	}
+	free(sorted);
+
+	for (i = 0; i < img->nseg; ++i) {
+		img->seg[i].offset = total;
+		total += img->seg[i].len;
+	}
+
+	if (!(img->data = malloc(total)))
+		return PARSER_ERR_SYSTEM;
+
+	for (i = 0; i < nrec; ++i) {
+		/* find the last segment starting at or before the record */
+		for (lo = 0, hi = img->nseg; hi - lo > 1; )
+			if (img->seg[(lo + hi) / 2].address <= rec[i].address)
+				lo = (lo + hi) / 2;
+			else
+				hi = (lo + hi) / 2;
+
+		memcpy(&img->data[img->seg[lo].offset + rec[i].address - img->seg[lo].address],
+			&raw[rec[i].offset], rec[i].len);
+	}
+
+	return PARSER_ERR_OK;
+}
+
+/* the flat image begins at address 0 and ends with the last segment */
+unsigned int image_size(image_t *img) {
+	if (!img->nseg) return 0;
+	return img->seg[img->nseg - 1].address + img->seg[img->nseg - 1].len;
+}
+
+/*
+	read the flat image of a parser from its segments, the gaps between
+	them read as 0xff. offset is the read position as an address and rseg
+	the segment at or after it, both kept by the caller
+*/
+parser_err_t image_read_segments(parser_err_t (*segment)(void *storage, unsigned int index, parser_seg_t *seg),
+	void *storage, uint32_t *offset, unsigned int *rseg, void *data, unsigned int *len)
+{
+	parser_seg_t	seg;
+	uint8_t		*pos = data;
+	unsigned int	left = *len, get;
+
+	while (left && segment(storage, *rseg, &seg) == PARSER_ERR_OK) {
+		if (*offset < seg.address) {
+			get = seg.address - *offset;
+			get = get > left ? left : get;
+			memset(pos, 0xff, get);
+		} else {
+			get = seg.address + seg.len - *offset;
+			get = get > left ? left : get;
+			memcpy(pos, &seg.data[*offset - seg.address], get);
+		}
+
+		*offset += get;
+		pos     += get;
+		left    -= get;
+		if (*offset == seg.address + seg.len)
+			++*rseg;
+	}
+
+	*len -= left;
+	return PARSER_ERR_OK;
+}
+
+static parser_err_t image_next(void *storage, unsigned int index, parser_seg_t *seg) {
+	return image_segment(storage, index, seg);
+}
+
+parser_err_t image_read(image_t *img, void *data, unsigned int *len) {
+	return image_read_segments(image_next, img, &img->offset, &img->rseg, data, len);
+}
+
+parser_err_t image_segment(image_t *img, unsigned int index, parser_seg_t *seg) {
+	if (index >= img->nseg) return PARSER_ERR_END;
+
+	seg->address	= img->seg[index].address;
+	seg->len	= img->seg[index].len;
+	seg->data	= &img->data[img->seg[index].offset];
+	return PARSER_ERR_OK;
+}
+
+/* what the gaps between segments read as in the flat image */
+static uint8_t image_fill[256];
+
+/*
+	point at the flat image at offset, the view ends with the segment or
+	gap it starts in so it is always backed by one piece of memory
+*/
+parser_err_t image_view(image_t *img, unsigned int offset, const uint8_t **data, unsigned int *len) {
+	image_seg_t	*seg;
+	unsigned int	lo, hi, left;
+
+	if (offset >= image_size(img))
+		return PARSER_ERR_END;
+
+	/* find the last segment starting at or before offset */
+	for (lo = 0, hi = img->nseg; hi - lo > 1; )
+		if (img->seg[(lo + hi) / 2].address <= offset)
+			lo = (lo + hi) / 2;
+		else
+			hi = (lo + hi) / 2;
+	seg = &img->seg[lo];
+
+	if (offset >= seg->address && offset < seg->address + seg->len) {
+		*data = &img->data[seg->offset + offset - seg->address];
+		left  = seg->address + seg->len - offset;
+	} else {
+		/* in front of the first segment or in the gap after seg */
+		if (!image_fill[0]) memset(image_fill, 0xff, sizeof(image_fill));
+		*data = image_fill;
+		left  = offset < seg->address ? seg->address - offset : seg[1].address - offset;
+		left  = left > sizeof(image_fill) ? sizeof(image_fill) : left;
+	}
+
+	if (*len > left) *len = left;
+	return PARSER_ERR_OK;
+}
+
+/* create the output file and its buffer */
+parser_err_t image_create(image_t *img, const char *filename) {
+	img->fd = open(
+		filename,
+		O_WRONLY | O_CREAT | O_TRUNC,
+#ifndef __WIN32__
+		S_IRUSR  | S_IWUSR | S_IRGRP | S_IROTH
+#else
+		0
+#endif
+	);
+	if (img->fd == -1)
+		return PARSER_ERR_SYSTEM;
+
+	if (!(img->out = malloc(IMAGE_OUT_SIZE))) {
+		close(img->fd);
+		img->fd = -1;
+		return PARSER_ERR_SYSTEM;
+	}
+
+	return PARSER_ERR_OK;
+}
+
+/* room for len bytes of output, the caller advances out_used by what it used */
+uint8_t *image_reserve(image_t *img, size_t len) {
+	if (img->out_used + len > IMAGE_OUT_SIZE && image_flush(img) != PARSER_ERR_OK)
+		return NULL;
+	return &img->out[img->out_used];
+}
+
+parser_err_t image_flush(image_t *img) {
+	uint8_t	*p = img->out;
+	ssize_t	r;
+
+	while (img->out_used > 0) {
+		r = write(img->fd, p, img->out_used);
+		if (r < 1) return PARSER_ERR_SYSTEM;
+		img->out_used -= r;
+		p             += r;
+	}
+
+	return PARSER_ERR_OK;
+}
+
+/* flush and close the output if there is one, then free the image */
+parser_err_t image_close(image_t *img) {
+	parser_err_t err = PARSER_ERR_OK;
+
+	if (img->out) {
+		err = image_flush(img);
+		if (close(img->fd) != 0)
+			err = PARSER_ERR_SYSTEM;
+	}
+
+	free(img->out);
+	free(img->data);
+	free(img->seg);
+	return err;
+}
@@ -0,0 +1,82 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  segment image shared by the text image parsers
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _PARSER_IMAGE_H
+#define _PARSER_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "parser.h"
+
+/* output is collected and written in chunks of this size */
+#define IMAGE_OUT_SIZE	65536
+
+typedef struct {
+	uint32_t	address;
+	unsigned int	len;
+	size_t		offset;		/* position of the data in the arena */
+} image_seg_t;
+
+typedef struct {
+	uint8_t		*data;		/* arena, the segment data back to back */
+	image_seg_t	*seg;		/* sorted by address and merged */
+	unsigned int	nseg;
+	uint32_t	offset;		/* read position, as an address */
+	unsigned int	rseg;		/* segment at or after the read position */
+
+	int		fd;		/* output file */
+	uint8_t		*out;		/* records waiting to be written */
+	size_t		out_used;
+} image_t;
+
+/* hex digit values, -1 for anything else */
+extern int8_t image_digit[256];
+extern const char image_hexchar[16];
+
+void image_init_digits();
+
+/* decode two hex digits, negative if either is invalid */
+static inline int image_hex_byte(const uint8_t *p) {
+	int hi = image_digit[p[0]], lo = image_digit[p[1]];
+	return (hi | lo) < 0 ? -1 : hi << 4 | lo;
+}
+
+/* encode b as two hex digits at p */
+static inline uint8_t *image_put_byte(uint8_t *p, uint8_t b) {
+	*p++ = image_hexchar[b >> 4];
+	*p++ = image_hexchar[b & 0xf];
+	return p;
+}
+
+uint8_t*     image_load   (const char *filename, size_t *len);
+parser_err_t image_merge  (image_t *img, const uint8_t *raw, const image_seg_t *rec, unsigned int nrec);
+unsigned int image_size   (image_t *img);
+parser_err_t image_read   (image_t *img, void *data, unsigned int *len);
+parser_err_t image_read_segments(parser_err_t (*segment)(void *storage, unsigned int index, parser_seg_t *seg),
+	void *storage, uint32_t *offset, unsigned int *rseg, void *data, unsigned int *len);
+parser_err_t image_segment(image_t *img, unsigned int index, parser_seg_t *seg);
+parser_err_t image_view   (image_t *img, unsigned int offset, const uint8_t **data, unsigned int *len);
+
+parser_err_t image_create (image_t *img, const char *filename);
+uint8_t*     image_reserve(image_t *img, size_t len);
+parser_err_t image_flush  (image_t *img);
+parser_err_t image_close  (image_t *img);
+
+#endif
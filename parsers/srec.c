@@ -0,0 +1,246 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  Motorola S-record parser
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "srec.h"
+#include "image.h"
+
+typedef struct {
+	image_t		img;
+	char		write;
+	uint8_t		type;		/* data record type written, 1..3 */
+	unsigned long	count;		/* data records written */
+} srec_t;
+
+/* data bytes per record, records never cross a multiple of this */
+#define SREC_REC_SIZE	16
+
+/* address bytes of each record type, 0 for reserved types */
+static const uint8_t srec_addr_len[10] = {2, 2, 3, 4, 0, 2, 3, 4, 3, 2};
+
+void* srec_init() {
+	srec_t *st;
+
+	image_init_digits();
+	if ((st = calloc(sizeof(srec_t), 1)))
+		st->img.fd = -1;
+	return st;
+}
+
+parser_err_t srec_open(void *storage, const char *filename, const char write) {
+	srec_t		*st = storage;
+	uint8_t		*buf, *p, *end;
+	uint8_t		*raw;
+	uint8_t		*record;
+	image_seg_t	*rec;
+	unsigned int	nrec = 0;
+	uint8_t		checksum;
+	size_t		len, used = 0;
+	uint32_t	address;
+	int		count, type, alen, c, i;
+	const char	*ext;
+	parser_err_t	err = PARSER_ERR_INVALID_FILE;
+
+	if (write) {
+		if (image_create(&st->img, filename) != PARSER_ERR_OK)
+			return PARSER_ERR_SYSTEM;
+
+		/* S19 has 16 bit, S37 32 bit addresses, anything else gets S28 for the 24 bit STM8 space */
+		ext = strrchr(filename, '.');
+		st->type  = ext && strcasecmp(ext, ".s19") == 0 ? 1 : ext && strcasecmp(ext, ".s37") == 0 ? 3 : 2;
+		st->write = 1;
+		return PARSER_ERR_OK;
+	}
+
+	if (!(buf = image_load(filename, &len)))
+		return PARSER_ERR_SYSTEM;
+
+	/* a record takes at least 10 characters and two per data byte, so these never grow */
+	raw = malloc(len / 2 + 1);
+	rec = malloc((len / 10 + 1) * sizeof(image_seg_t));
+	if (!raw || !rec) {
+		err = PARSER_ERR_SYSTEM;
+		goto out;
+	}
+
+	p   = buf;
+	end = buf + len;
+	while (p < end) {
+		if (*p == '\n' || *p == '\r') {
+			++p;
+			continue;
+		}
+
+		/* mark, type and count take 4 characters */
+		if (*p != 'S' || end - p < 4 || p[1] < '0' || p[1] > '9')
+			goto out;
+
+		type  = p[1] - '0';
+		alen  = srec_addr_len[type];
+		count = image_hex_byte(p + 2);
+		if (!alen || count < alen + 1 || end - p < 4 + 2 * count)
+			goto out;
+
+		/* decode address and data and build the checksum in one pass */
+		record   = &raw[used];
+		checksum = count;
+		for (i = 0; i < count - 1; ++i) {
+			if ((c = image_hex_byte(p + 4 + 2 * i)) < 0)
+				goto out;
+			record[i]  = c;
+			checksum  += c;
+		}
+
+		if ((c = image_hex_byte(p + 2 + 2 * count)) < 0 || (uint8_t)(checksum + c) != 0xff)
+			goto out;
+		p += 4 + 2 * count;
+
+		/* data records, S0 header, S5/S6 count and S7-S9 start address are not needed */
+		if (type >= 1 && type <= 3) {
+			for (address = 0, i = 0; i < alen; ++i)
+				address = address << 8 | record[i];
+
+			rec[nrec].address	= address;
+			rec[nrec].len		= count - 1 - alen;
+			rec[nrec].offset	= used + alen;
+			used += count - 1;
+			++nrec;
+		} else if (type >= 7)
+			break;
+	}
+
+	err = image_merge(&st->img, raw, rec, nrec);
+out:
+	free(rec);
+	free(raw);
+	free(buf);
+	return err;
+}
+
+/* format one record into the output buffer */
+static parser_err_t srec_record(srec_t *st, uint8_t type, uint32_t address, const uint8_t *data, uint8_t len) {
+	uint8_t		*p;
+	uint8_t		checksum;
+	unsigned int	i;
+	int		alen = srec_addr_len[type];
+
+	/* mark, type, count, address, data, checksum and newline */
+	if (!(p = image_reserve(&st->img, 4 + 2 * (alen + len + 1) + 1)))
+		return PARSER_ERR_SYSTEM;
+
+	*p++ = 'S';
+	*p++ = '0' + type;
+	p = image_put_byte(p, alen + len + 1);
+	checksum = alen + len + 1;
+	for (i = alen; i-- > 0; ) {
+		p = image_put_byte(p, address >> (8 * i));
+		checksum += address >> (8 * i);
+	}
+	for (i = 0; i < len; ++i) {
+		p = image_put_byte(p, data[i]);
+		checksum += data[i];
+	}
+	p = image_put_byte(p, ~checksum);
+	*p++ = '\n';
+
+	st->img.out_used = p - st->img.out;
+	return PARSER_ERR_OK;
+}
+
+parser_err_t srec_close(void *storage) {
+	srec_t *st = storage;
+	parser_err_t err = PARSER_ERR_OK;
+
+	if (st) {
+		/* record count and termination record */
+		if (st->write) {
+			if (srec_record(st, st->count > 0xffff ? 6 : 5, st->count, NULL, 0) != PARSER_ERR_OK ||
+			    srec_record(st, 10 - st->type, 0, NULL, 0) != PARSER_ERR_OK)
+				err = PARSER_ERR_SYSTEM;
+		}
+		if (image_close(&st->img) != PARSER_ERR_OK)
+			err = PARSER_ERR_SYSTEM;
+	}
+	free(st);
+	return err;
+}
+
+unsigned int srec_size(void *storage) {
+	srec_t *st = storage;
+	return image_size(&st->img);
+}
+
+parser_err_t srec_read(void *storage, void *data, unsigned int *len) {
+	srec_t *st = storage;
+	if (st->write) return PARSER_ERR_WRONLY;
+	return image_read(&st->img, data, len);
+}
+
+parser_err_t srec_write(void *storage, uint32_t address, void *data, unsigned int len) {
+	srec_t		*st = storage;
+	uint8_t		*pos = data;
+	unsigned int	n;
+
+	if (!st->write) return PARSER_ERR_RDONLY;
+
+	/* the address has to fit the record type picked from the file name */
+	if (st->type == 1 && address + len > 0x10000)
+		return PARSER_ERR_INVALID_FILE;
+
+	while (len > 0) {
+		n = SREC_REC_SIZE - address % SREC_REC_SIZE;
+		n = n > len ? len : n;
+		if (srec_record(st, st->type, address, pos, n) != PARSER_ERR_OK)
+			return PARSER_ERR_SYSTEM;
+		++st->count;
+
+		address += n;
+		pos     += n;
+		len     -= n;
+	}
+
+	return PARSER_ERR_OK;
+}
+
+parser_err_t srec_segment(void *storage, unsigned int index, parser_seg_t *seg) {
+	srec_t *st = storage;
+	return image_segment(&st->img, index, seg);
+}
+
+parser_err_t srec_view(void *storage, unsigned int offset, const uint8_t **data, unsigned int *len) {
+	srec_t *st = storage;
+	return image_view(&st->img, offset, data, len);
+}
+
+parser_t PARSER_SREC = {
+	"Motorola S-record",
+	srec_init,
+	srec_open,
+	srec_close,
+	srec_size,
+	srec_read,
+	srec_write,
+	srec_segment,
+	srec_view
+};
@@ -0,0 +1,436 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  per unit patch table
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	The patch is laid over the image as segments of its own, the image
+	segments are cut around them. Nothing of the image is copied, so the
+	writers still send every untouched block straight from the parser and
+	only assemble the blocks a patch entry falls into.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "patch.h"
+#include "parsers/image.h"
+
+#define PATCH_SEP	" \t,\r\n"
+
+typedef struct {
+	patch_t		*patch;
+	parser_t	*parser;	/* the image underneath, not owned */
+	void		*storage;
+	parser_seg_t	*seg;
+	unsigned int	nseg;
+	uint32_t	offset;		/* read position, as an address */
+	unsigned int	rseg;		/* segment at or after the read position */
+} patched_t;
+
+extern FILE *fp_stderr;
+
+/* the first line of a value file without the line end, -1 if the file is used up */
+static int patch_source(const char *source, char *text, unsigned int len) {
+	FILE *fp = fopen(source, "r");
+
+	if (!fp) {
+		perror(source);
+		return 1;
+	}
+	if (!fgets(text, len, fp) || text[strspn(text, "\r\n")] == 0) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	text[strcspn(text, "\r\n")] = 0;
+	return 0;
+}
+
+/* encode a number in the entry's width, most significant byte first */
+static void patch_number(patch_entry_t *e) {
+	unsigned int i;
+
+	for (i = 0; i < e->len; ++i)
+		e->data[i] = e->value >> (8 * (e->len - 1 - i));
+}
+
+/* fill in the entry from the text of its value */
+static int patch_value(patch_entry_t *e, const char *type, const char *text) {
+	char		*end;
+	unsigned int	i;
+	int		c;
+
+	if (strcmp(type, "u8") == 0 || strcmp(type, "u16") == 0 || strcmp(type, "u32") == 0) {
+		e->len    = type[1] == '8' ? 1 : type[1] == '1' ? 2 : 4;
+		e->value  = strtoul(text, &end, 0);
+		if (*end || end == text || e->value > (0xffffffffUL >> (32 - 8 * e->len))) {
+			fprintf(fp_stderr, "'%s' is not a %s value", text, type);
+			return 1;
+		}
+		patch_number(e);
+	} else if (strcmp(type, "hex") == 0) {
+		e->len = strlen(text) / 2;
+		if (strlen(text) % 2 || e->len == 0 || e->len > PATCH_MAX) {
+			fprintf(fp_stderr, "'%s' is not 1 to %d hex bytes", text, PATCH_MAX);
+			return 1;
+		}
+		for (i = 0; i < e->len; ++i) {
+			if ((c = image_hex_byte((const uint8_t *)&text[2 * i])) < 0) {
+				fprintf(fp_stderr, "'%s' is not a hex string", text);
+				return 1;
+			}
+			e->data[i] = c;
+		}
+	} else if (strcmp(type, "str") == 0) {
+		e->len = strlen(text);
+		if (e->len == 0 || e->len > PATCH_MAX) {
+			fprintf(fp_stderr, "'%s' is not 1 to %d characters", text, PATCH_MAX);
+			return 1;
+		}
+		memcpy(e->data, text, e->len);
+	} else {
+		fprintf(fp_stderr, "unknown type '%s', expected u8, u16, u32, hex or str", type);
+		return 1;
+	}
+
+	if (e->type != type)
+		strcpy(e->type, type);
+	return 0;
+}
+
+static int patch_cmp(const void *a, const void *b) {
+	const patch_entry_t *x = a, *y = b;
+	return x->address < y->address ? -1 : x->address > y->address;
+}
+
+patch_t* patch_load(const char *filename) {
+	patch_t		*patch;
+	patch_entry_t	*e;
+	FILE		*fp;
+	char		line[512], text[512];
+	char		*addr, *type, *value, *end;
+	unsigned int	lineno = 0, alloc = 0, i;
+	int		c;
+
+	image_init_digits();
+	if (!(fp = fopen(filename, "r"))) {
+		perror(filename);
+		return NULL;
+	}
+	if (!(patch = calloc(sizeof(patch_t), 1)))
+		goto fail;
+
+	while (fgets(line, sizeof(line), fp)) {
+		++lineno;
+		line[strcspn(line, "#")] = 0;
+		if (!(addr = strtok(line, PATCH_SEP)))
+			continue;
+
+		if (patch->count == alloc) {
+			alloc = alloc ? alloc * 2 : 16;
+			if (!(e = realloc(patch->entry, alloc * sizeof(patch_entry_t))))
+				goto fail;
+			patch->entry = e;
+		}
+		e = &patch->entry[patch->count++];
+		memset(e, 0, sizeof(*e));
+
+		type  = strtok(NULL, PATCH_SEP);
+		value = strtok(NULL, PATCH_SEP);
+		e->address = strtoul(addr, &end, 0);
+		if (*end || !type || !value || strtok(NULL, PATCH_SEP)) {
+			fprintf(fp_stderr, "%s:%u: expected address, type and value\n", filename, lineno);
+			goto fail;
+		}
+
+		if (value[0] == '@') {
+			if (!(e->source = strdup(value + 1)) || (c = patch_source(e->source, text, sizeof(text))) > 0)
+				goto fail;
+			if (c < 0) {
+				fprintf(fp_stderr, "%s: no value left\n", e->source);
+				goto fail;
+			}
+			value = text;
+		}
+
+		if (patch_value(e, type, value) != 0) {
+			fprintf(fp_stderr, " at %s:%u\n", filename, lineno);
+			goto fail;
+		}
+
+		/* the counter is moved on after this unit, that has to fit as well */
+		if (e->source && e->type[0] == 'u' && e->value == (0xffffffffUL >> (32 - 8 * e->len))) {
+			fprintf(fp_stderr, "%s: the %s counter would wrap after %s, at %s:%u\n",
+				e->source, e->type, value, filename, lineno);
+			goto fail;
+		}
+	}
+	fclose(fp);
+	fp = NULL;
+
+	qsort(patch->entry, patch->count, sizeof(patch_entry_t), patch_cmp);
+	for (i = 1; i < patch->count; ++i)
+		if (patch->entry[i].address < patch->entry[i - 1].address + patch->entry[i - 1].len) {
+			fprintf(fp_stderr, "%s: entries at 0x%08x and 0x%08x overlap\n",
+				filename, patch->entry[i - 1].address, patch->entry[i].address);
+			goto fail;
+		}
+
+	return patch;
+
+fail:
+	if (fp) fclose(fp);
+	patch_free(patch);
+	return NULL;
+}
+
+void patch_free(patch_t *patch) {
+	unsigned int i;
+
+	if (!patch) return;
+	for (i = 0; i < patch->count; ++i)
+		free(patch->entry[i].source);
+	free(patch->entry);
+	free(patch);
+}
+
+/* whether any entry has data in [start, end) */
+int patch_overlaps(const patch_t *patch, uint32_t start, uint32_t end) {
+	unsigned int i;
+
+	for (i = 0; i < patch->count && patch->entry[i].address < end; ++i)
+		if (patch->entry[i].address + patch->entry[i].len > start)
+			return 1;
+	return 0;
+}
+
+/* rewrite a value file in place of the old one */
+static int patch_replace(const char *source, const char *data, size_t len) {
+	char	tmp[4096];
+	FILE	*fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", source);
+	if (!(fp = fopen(tmp, "w")) || fwrite(data, 1, len, fp) != len) {
+		perror(tmp);
+		if (fp) fclose(fp);
+		return 1;
+	}
+	if (fclose(fp) != 0 || rename(tmp, source) != 0) {
+		perror(source);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+	a unit has been written, move every value file on to the next unit and
+	pick up the new values. A file used by several entries moves on once,
+	a list that runs out leaves the table spent for any further unit
+*/
+int patch_commit(patch_t *patch) {
+	patch_entry_t	*e;
+	char		text[512];
+	char		*data = NULL, *next;
+	size_t		len;
+	unsigned int	i, j;
+	FILE		*fp;
+	int		c, ret = 1;
+
+	for (i = 0; i < patch->count; ++i) {
+		e = &patch->entry[i];
+		if (!e->source) continue;
+		for (j = 0; j < i && !(patch->entry[j].source && strcmp(patch->entry[j].source, e->source) == 0); ++j);
+		if (j < i) continue;
+
+		if (e->type[0] == 'u') {
+			len = snprintf(text, sizeof(text), "%lu\n", e->value + 1);
+			if (patch_replace(e->source, text, len) != 0)
+				goto out;
+			continue;
+		}
+
+		/* drop the line that was used */
+		if (!(fp = fopen(e->source, "rb"))) {
+			perror(e->source);
+			goto out;
+		}
+		fseek(fp, 0, SEEK_END);
+		len = ftell(fp);
+		rewind(fp);
+		free(data);
+		if (!(data = malloc(len + 1)) || fread(data, 1, len, fp) != len) {
+			perror(e->source);
+			fclose(fp);
+			goto out;
+		}
+		fclose(fp);
+		data[len] = 0;
+		next = strchr(data, '\n');
+		next = next ? next + 1 : data + len;
+		if (patch_replace(e->source, next, data + len - next) != 0)
+			goto out;
+	}
+
+	/* the counters follow their files, lists take their next line */
+	for (i = 0; i < patch->count; ++i) {
+		e = &patch->entry[i];
+		if (!e->source) continue;
+
+		if (e->type[0] == 'u') {
+			++e->value;
+			patch_number(e);
+		} else if ((c = patch_source(e->source, text, sizeof(text))) < 0)
+			patch->spent = 1;
+		else if (c > 0)
+			goto out;
+		else if (patch_value(e, e->type, text) != 0) {
+			fprintf(fp_stderr, " in %s\n", e->source);
+			goto out;
+		}
+	}
+	ret = 0;
+
+out:
+	free(data);
+	return ret;
+}
+
+void* patched_init() {
+	return calloc(sizeof(patched_t), 1);
+}
+
+/* only made by patch_open */
+parser_err_t patched_open(void *storage, const char *filename, const char write) {
+	return PARSER_ERR_INVALID_FILE;
+}
+
+/* the image underneath stays open, it belongs to the caller */
+parser_err_t patched_close(void *storage) {
+	patched_t *st = storage;
+
+	if (st) free(st->seg);
+	free(st);
+	return PARSER_ERR_OK;
+}
+
+static int patched_cmp(const void *a, const void *b) {
+	const parser_seg_t *x = a, *y = b;
+	return x->address < y->address ? -1 : x->address > y->address;
+}
+
+static void patched_add(patched_t *st, uint32_t address, unsigned int len, const uint8_t *data) {
+	st->seg[st->nseg].address	= address;
+	st->seg[st->nseg].len		= len;
+	st->seg[st->nseg].data		= data;
+	++st->nseg;
+}
+
+/* lay the patch over the image, a raw image is placed at base */
+void* patch_open(patch_t *patch, parser_t *parser, void *storage, uint32_t base) {
+	patched_t	*st;
+	parser_iter_t	it;
+	parser_seg_t	s;
+	patch_entry_t	*e;
+	unsigned int	n = 0, i;
+	uint32_t	pos, end;
+
+	if (!(st = patched_init()))
+		return NULL;
+	st->patch	= patch;
+	st->parser	= parser;
+	st->storage	= storage;
+
+	/* each entry cuts at most one more piece out of the image */
+	parser_iter_init(&it, parser, storage, base);
+	while (parser_next(&it, &s) == PARSER_ERR_OK) ++n;
+	if (!(st->seg = malloc((n + 2 * patch->count) * sizeof(parser_seg_t)))) {
+		free(st);
+		return NULL;
+	}
+
+	for (i = 0; i < patch->count; ++i)
+		patched_add(st, patch->entry[i].address, patch->entry[i].len, patch->entry[i].data);
+
+	parser_iter_init(&it, parser, storage, base);
+	while (parser_next(&it, &s) == PARSER_ERR_OK) {
+		pos = s.address;
+		end = s.address + s.len;
+		for (i = 0; i < patch->count && pos < end; ++i) {
+			e = &patch->entry[i];
+			if (e->address + e->len <= pos) continue;
+			if (e->address >= end) break;
+			if (e->address > pos)
+				patched_add(st, pos, e->address - pos, &s.data[pos - s.address]);
+			pos = e->address + e->len;
+		}
+		if (pos < end)
+			patched_add(st, pos, end - pos, &s.data[pos - s.address]);
+	}
+
+	qsort(st->seg, st->nseg, sizeof(parser_seg_t), patched_cmp);
+	return st;
+}
+
+parser_t* patch_parser(void *storage) {
+	patched_t *st = storage;
+	return st->parser;
+}
+
+void* patch_storage(void *storage) {
+	patched_t *st = storage;
+	return st->storage;
+}
+
+unsigned int patched_size(void *storage) {
+	patched_t *st = storage;
+
+	if (!st->nseg) return 0;
+	return st->seg[st->nseg - 1].address + st->seg[st->nseg - 1].len;
+}
+
+parser_err_t patched_segment(void *storage, unsigned int index, parser_seg_t *seg) {
+	patched_t *st = storage;
+
+	if (index >= st->nseg) return PARSER_ERR_END;
+	*seg = st->seg[index];
+	return PARSER_ERR_OK;
+}
+
+/* read the flat image from address 0, the gaps read as 0xff */
+parser_err_t patched_read(void *storage, void *data, unsigned int *len) {
+	patched_t *st = storage;
+	return image_read_segments(patched_segment, storage, &st->offset, &st->rseg, data, len);
+}
+
+parser_err_t patched_write(void *storage, uint32_t address, void *data, unsigned int len) {
+	return PARSER_ERR_RDONLY;
+}
+
+parser_t PARSER_PATCH = {
+	"Patched image",
+	patched_init,
+	patched_open,
+	patched_close,
+	patched_size,
+	patched_read,
+	patched_write,
+	patched_segment,
+	NULL
+};
@@ -0,0 +1,71 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  per unit patch table
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _PATCH_H
+#define _PATCH_H
+
+#include <stdint.h>
+#include "parser.h"
+
+/*
+	A patch table lays per unit bytes over an image, one entry per line:
+
+		address type value
+
+	with the fields separated by blanks or commas and # starting a
+	comment. type is u8, u16 or u32 for a big endian number, hex for a
+	byte string or str for text. A value of @file takes it from file: a
+	number there is a counter that goes up by one after each unit and is
+	refused once the next value would not fit its type, for hex and str
+	the first line is used and removed after each unit.
+*/
+#define PATCH_MAX	64	/* bytes per entry */
+
+typedef struct patch_entry patch_entry_t;
+typedef struct patch       patch_t;
+
+struct patch_entry {
+	uint32_t	address;
+	unsigned int	len;
+	uint8_t		data[PATCH_MAX];
+	char		type[4];	/* u8, u16, u32, hex or str */
+	unsigned long	value;		/* for the numbers */
+	char		*source;	/* file the value came from, NULL if given */
+};
+
+struct patch {
+	patch_entry_t	*entry;		/* sorted by address, never overlapping */
+	unsigned int	count;
+	char		spent;		/* a list ran out, no values for another unit */
+};
+
+/* the image with the patch laid over it, opened with patch_open */
+extern parser_t PARSER_PATCH;
+
+patch_t* patch_load    (const char *filename);
+void     patch_free    (patch_t *patch);
+int      patch_overlaps(const patch_t *patch, uint32_t start, uint32_t end);
+int      patch_commit  (patch_t *patch);
+
+void*     patch_open   (patch_t *patch, parser_t *parser, void *storage, uint32_t base);
+parser_t* patch_parser (void *storage);
+void*     patch_storage(void *storage);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  plays the device side of a serial line trace
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	stm8replay opens a pseudo terminal and acts as the device of a trace
+	taken with stm8flash -t: it waits for the bytes the host sent and
+	answers with the bytes the device sent, as long after the host as in
+	the trace. Running stm8flash with the same arguments against the
+	pseudo terminal repeats the session, timeouts included, without the
+	board. Bytes from the host that differ from the trace are reported.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define REPLAY_QUIET	10000	/* ms to wait for the host before giving up */
+
+FILE *fp_stderr;
+
+static uint64_t replay_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int replay_open(FILE *fp, const char *filename) {
+	char magic[TRACE_HEADER_SIZE];
+
+	if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, TRACE_MAGIC, TRACE_HEADER_SIZE) != 0) {
+		fprintf(stderr, "%s is not a trace\n", filename);
+		return 1;
+	}
+	return 0;
+}
+
+/* the trace as text, one line per record */
+static int replay_dump(FILE *fp) {
+	trace_rec_t	rec;
+	unsigned int	i;
+	int		r;
+
+	while ((r = trace_read(fp, &rec)) == 0) {
+		printf("%4u.%06u %c", (unsigned int)(rec.time / 1000000), (unsigned int)(rec.time % 1000000),
+			rec.dir == TRACE_OUT ? '>' : rec.dir == TRACE_IN ? '<' : '.');
+		for (i = 0; i < rec.len; ++i)
+			printf(" %02x", rec.data[i]);
+		printf(rec.dir == TRACE_IDLE ? " no data\n" : "\n");
+	}
+	return r < 0;
+}
+
+/* a pseudo terminal in raw mode, its slave is kept open so it is there before the host comes */
+static int replay_pty(int *slave) {
+	struct termios	tio;
+	int		fd;
+	char		*name;
+
+	if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0 ||
+	    !(name = ptsname(fd)) || (*slave = open(name, O_RDWR | O_NOCTTY)) < 0) {
+		perror("pseudo terminal");
+		return -1;
+	}
+
+	tcgetattr(*slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(*slave, TCSANOW, &tio);
+
+	printf("Replaying on %s\n", name);
+	fflush(stdout);
+	return fd;
+}
+
+static int replay(FILE *fp) {
+	struct pollfd	pfd;
+	trace_rec_t	rec;
+	uint64_t	base = 0, now;
+	unsigned int	i, records = 0, differ = 0;
+	uint8_t		byte;
+	int		fd, slave, r;
+
+	if ((fd = replay_pty(&slave)) < 0)
+		return 1;
+	pfd.fd	   = fd;
+	pfd.events = POLLIN;
+
+	while ((r = trace_read(fp, &rec)) == 0) {
+		++records;
+		switch (rec.dir) {
+			case TRACE_OUT:
+				for (i = 0; i < rec.len; ++i) {
+					if (poll(&pfd, 1, REPLAY_QUIET) != 1 || read(fd, &byte, 1) != 1) {
+						fprintf(stderr, "The host went quiet at %u.%06u s, record %u\n",
+							(unsigned int)(rec.time / 1000000), (unsigned int)(rec.time % 1000000), records);
+						r = 1;
+						goto out;
+					}
+					if (byte != rec.data[i] && differ++ < 16)
+						fprintf(stderr, "The host sent 0x%02x at %u.%06u s, the trace has 0x%02x\n", byte,
+							(unsigned int)(rec.time / 1000000), (unsigned int)(rec.time % 1000000), rec.data[i]);
+				}
+				/* the device answers relative to the host, wherever the host is now */
+				base = replay_now() - rec.time;
+				break;
+
+			case TRACE_IN:
+				now = replay_now();
+				if (base + rec.time > now)
+					usleep(base + rec.time - now);
+				if (write(fd, rec.data, rec.len) != rec.len) {
+					perror("write");
+					r = 1;
+					goto out;
+				}
+				break;
+
+			case TRACE_IDLE:
+				/* the silence is kept by the time of the next answer */
+				break;
+		}
+	}
+
+	if (r < 0)
+		fprintf(stderr, "The trace is damaged after record %u\n", records);
+	printf("Replayed %u records, %u bytes from the host differed\n", records, differ);
+
+	/* let the host read the last answer before the line goes away */
+	tcdrain(fd);
+	usleep(100000);
+out:
+	close(slave);
+	close(fd);
+	return r != 0 || differ;
+}
+
+int main(int argc, char *argv[]) {
+	FILE	*fp;
+	int	dump = 0, c, ret;
+
+	fp_stderr = stderr;
+	while ((c = getopt(argc, argv, "dh")) != -1) {
+		switch (c) {
+			case 'd':
+				dump = 1;
+				break;
+			default:
+				fprintf(stderr,
+					"Usage: %s [-d] trace\n"
+					"	Act as the device of a trace taken with stm8flash -t on a\n"
+					"	pseudo terminal, run stm8flash on the terminal it prints.\n"
+					"	-d	Print the trace instead, '>' from the host, '<' from the device\n",
+					argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-d] trace\n", argv[0]);
+		return 1;
+	}
+
+	if (!(fp = fopen(argv[optind], "rb"))) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (replay_open(fp, argv[optind]) != 0) {
+		fclose(fp);
+		return 1;
+	}
+
+	ret = dump ? replay_dump(fp) : replay(fp);
+	fclose(fp);
+	return ret;
+}
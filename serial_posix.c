@@ -30,6 +30,7 @@
 #include <linux/serial.h>
 
 #include "serial.h"
+#include "trace.h"
 
 struct serial {
 	int			fd;
@@ -207,6 +208,7 @@ serial_err_t serial_write(const serial_t *h, const void *buffer, unsigned int le
 	while(len > 0) {
 		r = write(h->fd, pos, len);
 		if (r < 1) return SERIAL_ERR_SYSTEM;
+		trace_record(TRACE_OUT, pos, r);
 
 		len -= r;
 		pos += r;
@@ -223,8 +225,9 @@ serial_err_t serial_read(const serial_t *h, const void *buffer, unsigned int len
 
 	while(len > 0) {
 		r = read(h->fd, pos, len);
-		      if (r == 0) return SERIAL_ERR_NODATA;
+		      if (r == 0) { trace_record(TRACE_IDLE, NULL, 0); return SERIAL_ERR_NODATA; }
 		else  if (r <  0) return SERIAL_ERR_SYSTEM;
+		trace_record(TRACE_IN, pos, r);
 
 		len -= r;
 		pos += r;
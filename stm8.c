@@ -21,6 +21,10 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <signal.h>
 
 #include "stm8.h"
 #include "utils.h"
@@ -41,14 +45,53 @@ struct stm8_cmd {
 	uint8_t er; /* this may be extended erase */
 };
 
+/* counters and latencies of each command by phase, see stm8_stats_print */
+typedef enum {
+	STM8_STAT_GET,
+	STM8_STAT_READ,
+	STM8_STAT_WRITE,
+	STM8_STAT_ERASE,
+	STM8_STAT_GO,
+	STM8_STAT_CMDS
+} stm8_stat_cmd_t;
+
+typedef enum {
+	STM8_PHASE_CMD,		/* command and its ACK */
+	STM8_PHASE_ADDR,	/* address frame and its ACK */
+	STM8_PHASE_SLEEP,	/* the wait before a write or erase is expected to end */
+	STM8_PHASE_DATA,	/* length or data out, or the end of the sleep, and the first byte back */
+	STM8_PHASE_BUSY,	/* from the first BUSY to the answer */
+	STM8_PHASES
+} stm8_phase_t;
+
+#define STM8_HIST_BINS	24	/* bin n counts latencies from 2^n us, up to 2^n+1 */
+#define STM8_WAIT_READY	1000	/* us, an answer read sooner after a sleep was waiting already */
+
+typedef struct {
+	uint32_t	count, nack, max;
+	uint64_t	bytes, total;
+	uint32_t	hist[STM8_HIST_BINS];
+} stm8_stat_t;
+
+struct stm8_stats {
+	stm8_stat_t	stat[STM8_STAT_CMDS][STM8_PHASES];
+	uint32_t	busy;		/* BUSY bytes echoed */
+};
+
+static const char *stm8_stat_cmds[STM8_STAT_CMDS] = { "GET", "READ", "WRITE", "ERASE", "GO" };
+static const char *stm8_phases[STM8_PHASES]	  = { "command", "address", "sleep", "data", "busy" };
+
+/* set by stm8_stats_signal, the statistics are shown before the next command */
+static volatile sig_atomic_t stm8_stats_wanted;
+
 /* device table */
 const stm8_dev_t devices[] = {
-	{0x010, "Medium density STM8S 32kB", 0x000000, 0x0007FF, 0x008000, 0x00FFFF, 1, 512, 0x004800, 0x00487F, 0x004000, 0x0043FF},
-	{0x012, "Medium density STM8S 32kB", 0x000000, 0x0007FF, 0x008000, 0x00FFFF, 1, 512, 0x004800, 0x00487F, 0x004000, 0x0043FF},
-	{0x013, "Medium density STM8S 32kB", 0x000000, 0x0007FF, 0x008000, 0x00FFFF, 1, 512, 0x004800, 0x00487F, 0x004000, 0x0043FF},
-	{0x020, "High density STM8S 128kB", 0x000000, 0x0007FF, 0x008000, 0x027FFF, 1, 512, 0x004800, 0x00487F, 0x004000, 0x0047FF},
-	{0x021, "High density STM8S 128kB", 0x000000, 0x0007FF, 0x008000, 0x027FFF, 1, 512, 0x004800, 0x00487F, 0x004000, 0x0047FF},
-	{0x022, "High density STM8S 128kB", 0x000000, 0x0007FF, 0x008000, 0x027FFF, 1, 512, 0x004800, 0x00487F, 0x004000, 0x0047FF},
+	{0x010, "Medium density STM8S 32kB", 0x000000, 0x0007FF, 0x008000, 0x00FFFF, 8, 128, 0x004800, 0x00487F, 0x004000, 0x0043FF, 0x0048CD, 6000, 27000},
+	{0x012, "Medium density STM8S 32kB", 0x000000, 0x0007FF, 0x008000, 0x00FFFF, 8, 128, 0x004800, 0x00487F, 0x004000, 0x0043FF, 0x0048CD, 6000, 27000},
+	{0x013, "Medium density STM8S 32kB", 0x000000, 0x0007FF, 0x008000, 0x00FFFF, 8, 128, 0x004800, 0x00487F, 0x004000, 0x0043FF, 0x0048CD, 6000, 27000},
+	{0x020, "High density STM8S 128kB", 0x000000, 0x0007FF, 0x008000, 0x027FFF, 8, 128, 0x004800, 0x00487F, 0x004000, 0x0047FF, 0x0048CD, 6000, 27000},
+	{0x021, "High density STM8S 128kB", 0x000000, 0x0007FF, 0x008000, 0x027FFF, 8, 128, 0x004800, 0x00487F, 0x004000, 0x0047FF, 0x0048CD, 6000, 27000},
+	{0x022, "High density STM8S 128kB", 0x000000, 0x0007FF, 0x008000, 0x027FFF, 8, 128, 0x004800, 0x00487F, 0x004000, 0x0047FF, 0x0048CD, 6000, 27000},
 	{0x0}
 };
 
@@ -60,6 +103,44 @@ uint8_t stm8_gen_cs(const uint32_t v);
 void    stm8_send_byte(const stm8_t *stm, uint8_t byte);
 uint8_t stm8_read_byte(const stm8_t *stm);
 char    stm8_send_command(const stm8_t *stm, const uint8_t cmd);
+static char stm8_connect(stm8_t *stm);
+
+static uint64_t stm8_now(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static void stm8_sleep(uint64_t us) {
+	if (us >= 1000000) sleep(us / 1000000);
+	usleep(us % 1000000);
+}
+
+static void stm8_record(const stm8_t *stm, stm8_stat_cmd_t cmd, stm8_phase_t phase, uint64_t start, unsigned int bytes, char ok) {
+	stm8_stat_t	*st = &stm->stats->stat[cmd][phase];
+	uint64_t	us = stm8_now() - start;
+	unsigned int	bin = 0;
+
+	while (bin < STM8_HIST_BINS - 1 && us >> (bin + 1))
+		++bin;
+
+	++st->count;
+	st->nack  += !ok;
+	st->bytes += bytes;
+	st->total += us;
+	st->max	   = us > st->max ? us : st->max;
+	++st->hist[bin];
+}
+
+static stm8_stat_cmd_t stm8_stat_cmd(const stm8_t *stm, uint8_t cmd) {
+	/* the first GET is sent before the commands are known */
+	if (cmd == STM8_CMD_GET || cmd == stm->cmd->get) return STM8_STAT_GET;
+	if (cmd == stm->cmd->rm ) return STM8_STAT_READ;
+	if (cmd == stm->cmd->wm ) return STM8_STAT_WRITE;
+	if (cmd == stm->cmd->er ) return STM8_STAT_ERASE;
+	return STM8_STAT_GO;
+}
 
 /* stm8 programs */
 extern unsigned int	stmreset_length;
@@ -95,9 +176,20 @@ uint8_t stm8_read_byte(const stm8_t *stm) {
 }
 
 char stm8_send_command(const stm8_t *stm, const uint8_t cmd) {
+	uint64_t start;
+	char ok;
+
+	if (stm8_stats_wanted) {
+		stm8_stats_wanted = 0;
+		stm8_stats_print(stm, fp_stderr);
+	}
+
+	start = stm8_now();
 	stm8_send_byte(stm, cmd);
 	stm8_send_byte(stm, cmd ^ 0xFF);
-	if (stm8_read_byte(stm) != STM8_ACK) {
+	ok = stm8_read_byte(stm) == STM8_ACK;
+	stm8_record(stm, stm8_stat_cmd(stm, cmd), STM8_PHASE_CMD, start, 0, ok);
+	if (!ok) {
 		fprintf(fp_stderr, "Error sending command 0x%02x to device\n", cmd);
 		return 0;
 	}
@@ -138,14 +230,12 @@ uint8_t *stm8_get_e_w_routine(int *len, char bl_version)
 	
 
 stm8_t* stm8_init(const serial_t *serial, const char init) {
-	uint8_t len;
 	stm8_t *stm;
-	int routine_len;
-	int routine_offset;
-	uint8_t *routine_data;
 
-	stm      = calloc(sizeof(stm8_t), 1);
-	stm->cmd = calloc(sizeof(stm8_cmd_t), 1);
+	stm         = calloc(sizeof(stm8_t), 1);
+	stm->cmd    = calloc(sizeof(stm8_cmd_t), 1);
+	stm->timing = calloc(sizeof(stm8_timing_t), 1);
+	stm->stats  = calloc(sizeof(stm8_stats_t), 1);
 	stm->serial = serial;
 
 	if (init) {
@@ -157,8 +247,27 @@ stm8_t* stm8_init(const serial_t *serial, const char init) {
 		}
 	}
 
+	if (!stm8_connect(stm)) {
+		stm8_close(stm);
+		return NULL;
+	}
+
+	stm->timing->expect[STM8_TIME_WRITE] = stm->dev->t_write;
+	stm->timing->expect[STM8_TIME_ERASE] = stm->dev->t_erase;
+	return stm;
+}
+
+/* ask for the bootloader information and load the E/W routines, after INIT */
+static char stm8_connect(stm8_t *stm) {
+	uint64_t start;
+	uint8_t len;
+	int routine_len;
+	int routine_offset;
+	uint8_t *routine_data;
+
 	/* get the bootloader information */
 	if (!stm8_send_command(stm, STM8_CMD_GET)) return 0;
+	start            = stm8_now();
 	len              = stm8_read_byte(stm) + 1;
 	stm->bl_version  = stm8_read_byte(stm); --len;
 	stm->cmd->get    = stm8_read_byte(stm); --len;
@@ -172,9 +281,10 @@ stm8_t* stm8_init(const serial_t *serial, const char init) {
 	}
 
 	if (stm8_read_byte(stm) != STM8_ACK) {
-		stm8_close(stm);
-		return NULL;
+		stm8_record(stm, STM8_STAT_GET, STM8_PHASE_DATA, start, 0, 0);
+		return 0;
 	}
+	stm8_record(stm, STM8_STAT_GET, STM8_PHASE_DATA, start, 6, 1);
 
 
 	//FIX ME: Points to first device in List
@@ -182,7 +292,7 @@ stm8_t* stm8_init(const serial_t *serial, const char init) {
 	if(!stm->dev)
 	{
 		fprintf(fp_stderr, "Device Information not found - check device table in stm8.c\n");
-		return NULL;	
+		return 0;
 	}
 
 
@@ -191,37 +301,100 @@ stm8_t* stm8_init(const serial_t *serial, const char init) {
 	if(!routine_data)
 	{
 		fprintf(fp_stderr, "Erase and Write Routines for Bootloader-Version not found!\n");
-		return NULL;	
+		return 0;
 	}
 
 	routine_offset = 0x0;
+	stm->routine_end = STM8_E_W_ROUTINE_ADDR + routine_len;
 
 	while(routine_len)
 	{
 		if(routine_len > 128)
 		{
-			if(!stm8_write_memory(stm, 0xA0 + routine_offset,&routine_data[routine_offset],128))
+			if(!stm8_write_memory(stm, STM8_E_W_ROUTINE_ADDR + routine_offset,&routine_data[routine_offset],128))
 				return 0;
 			routine_len-=128;
 			routine_offset+=128;
 		} else {
-			if(!stm8_write_memory(stm, 0xA0 + routine_offset,&routine_data[routine_offset],routine_len))
+			if(!stm8_write_memory(stm, STM8_E_W_ROUTINE_ADDR + routine_offset,&routine_data[routine_offset],routine_len))
 				return 0;
 			routine_len=0;
 		}
 	}
 
-	return stm;
+	return 1;
 }
 
 void stm8_close(stm8_t *stm) {
-	if (stm) free(stm->cmd);
+	if (stm) {
+		free(stm->cmd);
+		free(stm->timing);
+		free(stm->stats);
+	}
 	free(stm);
 }
 
+/*
+	wait for the answer to a write or an erase of count sectors. The
+	device is left alone for most of the time it is expected to take,
+	then read until the answer comes. A slow device gets four times the
+	expected time and a second before it is given up on, however long the
+	erase. The time the device took refines the expectation for the next
+	wait
+*/
+static uint8_t stm8_wait(const stm8_t *stm, stm8_time_t kind, unsigned int count, unsigned int bytes) {
+	stm8_timing_t	*t = stm->timing;
+	stm8_stat_cmd_t	cmd = kind == STM8_TIME_WRITE ? STM8_STAT_WRITE : STM8_STAT_ERASE;
+	uint64_t	start = stm8_now(), expect = (uint64_t)t->expect[kind] * count, took, data, answer, busy = 0;
+	uint8_t		byte;
+	serial_err_t	err;
+
+	/* the sleep is kept apart, so data is the line latency and busy the wait for the device */
+	stm8_sleep(expect * 3 / 4);
+	data = stm8_now();
+	stm8_record(stm, cmd, STM8_PHASE_SLEEP, start, 0, 1);
+	for (;;) {
+		err = serial_read(stm->serial, &byte, 1);
+		if (err == SERIAL_ERR_OK) {
+			answer = stm8_now();
+			//REPLY-MODE, BUSY is echoed too
+			stm8_send_byte(stm, byte);
+			if (!busy)
+				stm8_record(stm, cmd, STM8_PHASE_DATA, data, bytes, byte == STM8_ACK || byte == STM8_BUSY);
+			if (byte != STM8_BUSY) break;
+			if (!busy) busy = stm8_now();
+			++stm->stats->busy;
+			continue;
+		}
+		if (err != SERIAL_ERR_NODATA || stm8_now() - start > expect * 4 + 1000000) {
+			fprintf(fp_stderr, "No answer from the device after %u ms\n", (unsigned int)((stm8_now() - start) / 1000));
+			stm8_record(stm, cmd, busy ? STM8_PHASE_BUSY : STM8_PHASE_DATA, busy ? busy : data, 0, 0);
+			return STM8_NACK;
+		}
+	}
+	if (busy)
+		stm8_record(stm, cmd, STM8_PHASE_BUSY, busy, 0, byte == STM8_ACK);
+
+	t->spent[kind] += stm8_now() - start;
+	t->units[kind] += count;
+
+	/*
+		the device is timed only when it was waited for. An answer there
+		as soon as the sleep ended came sooner than that, by how much is
+		not known, so the expectation is brought down until it is
+	*/
+	took = answer - start;
+	if (!busy && answer - data < STM8_WAIT_READY)
+		took = (data - start) / 2;
+	t->expect[kind] = (t->expect[kind] * 3 + took / count) / 4;
+	return byte;
+}
+
 char stm8_read_memory(const stm8_t *stm, uint32_t address, uint8_t data[], unsigned int len) {
 	uint8_t cs;
 	unsigned int i;
+	uint64_t start;
+	char ok;
 	assert(len > 0 && len < 257);
 
 	/* must be 32bit aligned */
@@ -231,110 +404,397 @@ char stm8_read_memory(const stm8_t *stm, uint32_t address, uint8_t data[], unsig
 	cs      = stm8_gen_cs(address);
 
 	if (!stm8_send_command(stm, stm->cmd->rm)) return 0;
+	start = stm8_now();
 	assert(serial_write(stm->serial, &address, 4) == SERIAL_ERR_OK);
 	stm8_send_byte(stm, cs);
-	if (stm8_read_byte(stm) != STM8_ACK) return 0;
+	ok = stm8_read_byte(stm) == STM8_ACK;
+	stm8_record(stm, STM8_STAT_READ, STM8_PHASE_ADDR, start, 0, ok);
+	if (!ok) return 0;
 
+	start = stm8_now();
 	i = len - 1;
 	stm8_send_byte(stm, i);
 	stm8_send_byte(stm, i ^ 0xFF);
-	if (stm8_read_byte(stm) != STM8_ACK) return 0;
+	if (stm8_read_byte(stm) != STM8_ACK) {
+		stm8_record(stm, STM8_STAT_READ, STM8_PHASE_DATA, start, 0, 0);
+		return 0;
+	}
 
 	i=0;
 	while(len--) data[i++] = stm8_read_byte(stm);
+	stm8_record(stm, STM8_STAT_READ, STM8_PHASE_DATA, start, i, 1);
 
 //	assert(serial_read(stm->serial, data, len) == SERIAL_ERR_OK);
 	return 1;
 }
 
-char stm8_write_memory(const stm8_t *stm, uint32_t address, uint8_t data[], unsigned int len) {
-	uint8_t cs;
+/* build the address and data frames of a WRITE, they need no device to be built */
+void stm8_frame_write(uint32_t address, const uint8_t data[], unsigned int len, uint8_t addr_frame[], uint8_t data_frame[]) {
 	unsigned int i;
-//	int c;
-//	int extra;
-	char ack;
+	uint8_t cs;
+
 	assert(len > 0 && len < 129);
 
-//	/* must be 32bit aligned */
-//	assert(address % 4 == 0);
+	addr_frame[0] = address >> 24;
+	addr_frame[1] = address >> 16;
+	addr_frame[2] = address >> 8;
+	addr_frame[3] = address;
+	addr_frame[4] = stm8_gen_cs(address);
 
-	address = be_u32      (address);
-	cs      = stm8_gen_cs(address);
+	/* the length, the data and the xor of both */
+	cs = data_frame[0] = len - 1;
+	for(i = 0; i < len; ++i)
+		cs ^= data_frame[i + 1] = data[i];
+	data_frame[len + 1] = cs;
+}
+
+static char stm8_programmed(const stm8_t *stm, uint32_t address) {
+	const stm8_dev_t *dev = stm->dev;
+
+	return (address >= dev->fl_start  && address <= dev->fl_end ) ||
+	       (address >= dev->mem_start && address <= dev->mem_end) ||
+	       (address >= dev->opt_start && address <= dev->opt_end);
+}
+
+/* send a WRITE from frames built by stm8_frame_write, each frame goes out in one write */
+char stm8_write_framed(const stm8_t *stm, const uint8_t addr_frame[], const uint8_t data_frame[], unsigned int len) {
+	uint8_t ack;
+	uint64_t start;
 
-	/* send the address and checksum */
 	if (!stm8_send_command(stm, stm->cmd->wm)) return 0;
-	assert(serial_write(stm->serial, &address, 4) == SERIAL_ERR_OK);
-	stm8_send_byte(stm, cs);
+	start = stm8_now();
+	assert(serial_write(stm->serial, addr_frame, STM8_ADDR_FRAME) == SERIAL_ERR_OK);
 
 	do {
 		ack = stm8_read_byte(stm);
-	} while (ack == STM8_BUSY);	
+		stm->stats->busy += ack == STM8_BUSY;
+	} while (ack == STM8_BUSY);
+	stm8_record(stm, STM8_STAT_WRITE, STM8_PHASE_ADDR, start, 0, ack == STM8_ACK);
 	if (ack != STM8_ACK) return 0;
 
-	/* setup the cs and send the length */
-//	extra = len % 4;
-//	cs = len - 1 + extra;
-	cs = len - 1;
-	stm8_send_byte(stm, cs);
-
-	/* write the data and build the checksum */
-	for(i = 0; i < len; ++i)
-		cs ^= data[i];
+	assert(serial_write(stm->serial, data_frame, STM8_DATA_FRAME(len)) == SERIAL_ERR_OK);
 
-	assert(serial_write(stm->serial, data, len) == SERIAL_ERR_OK);
-
-	/* write the alignment padding */
-/*	for(c = 0; c < extra; ++c) {
-		stm8_send_byte(stm, 0xFF);
-		cs ^= 0xFF;
-	}
-*/
-
-	/* send the checksum */
-	stm8_send_byte(stm, cs);
+	/* only flash, EEPROM and option bytes are programmed, RAM answers at once */
+	if (stm8_programmed(stm, addr_frame[0] << 24 | addr_frame[1] << 16 | addr_frame[2] << 8 | addr_frame[3]))
+		return stm8_wait(stm, STM8_TIME_WRITE, 1, len) == STM8_ACK;
 
+	start = stm8_now();
 	do {
 		ack = stm8_read_byte(stm);
-	} while (ack == STM8_BUSY);	
+		stm->stats->busy += ack == STM8_BUSY;
+	} while (ack == STM8_BUSY);
+	stm8_record(stm, STM8_STAT_WRITE, STM8_PHASE_DATA, start, len, ack == STM8_ACK);
 	return ack == STM8_ACK;
+}
 
+char stm8_write_memory(const stm8_t *stm, uint32_t address, const uint8_t data[], unsigned int len) {
+	uint8_t addr_frame[STM8_ADDR_FRAME];
+	uint8_t data_frame[STM8_DATA_FRAME(128)];
+
+	stm8_frame_write(address, data, len, addr_frame, data_frame);
+	return stm8_write_framed(stm, addr_frame, data_frame, len);
 }
 
 char stm8_erase_memory(const stm8_t *stm, uint8_t pages) {
-	char ack;
+	uint8_t sectors[256];
+	unsigned int i;
 
-	if (!stm8_send_command(stm, stm->cmd->er)) return 0;
+	/* the whole flash, which takes longer than the read timeout */
 	if (pages == 0xFF) {
-		return stm8_send_command(stm, 0xFF);
-	} else {
-		uint8_t cs = 0;
-		uint8_t pg_num;
-		stm8_send_byte(stm, pages);
-		cs ^= pages;
-		for (pg_num = 0; pg_num <= pages; pg_num++) {
-			stm8_send_byte(stm, pg_num);
-			cs ^= pg_num;
-		}
-		stm8_send_byte(stm, cs);
+		if (!stm8_send_command(stm, stm->cmd->er)) return 0;
+		stm8_send_byte(stm, 0xFF);
+		stm8_send_byte(stm, 0x00);
+		return stm8_wait(stm, STM8_TIME_ERASE,
+			(stm->dev->fl_end + 1 - stm->dev->fl_start) / (stm->dev->fl_pps * stm->dev->fl_ps), 2) == STM8_ACK;
+	}
+
+	for (i = 0; i <= pages; i++)
+		sectors[i] = i;
+	return stm8_erase_sectors(stm, sectors, pages + 1);
+}
+
+char stm8_erase_sectors(const stm8_t *stm, const uint8_t sectors[], unsigned int count) {
+	uint8_t cs;
+	unsigned int i;
+	assert(count > 0 && count < 256);
+
+	if (!stm8_send_command(stm, stm->cmd->er)) return 0;
 
-		do {
-			ack = stm8_read_byte(stm);
-		} while (ack == STM8_BUSY);	
-		return ack == STM8_ACK;
+	/* the sector count is sent as N - 1 */
+	cs = count - 1;
+	stm8_send_byte(stm, cs);
+	for (i = 0; i < count; i++) {
+		stm8_send_byte(stm, sectors[i]);
+		cs ^= sectors[i];
 	}
+	stm8_send_byte(stm, cs);
+
+	return stm8_wait(stm, STM8_TIME_ERASE, count, count + 2) == STM8_ACK;
 }
 
 char stm8_go(const stm8_t *stm, uint32_t address) {
 	uint8_t cs;
+	uint64_t start;
+	char ok;
 
 	address = be_u32      (address);
 	cs      = stm8_gen_cs(address);
 
 	if (!stm8_send_command(stm, stm->cmd->go)) return 0;
+	start = stm8_now();
 	serial_write(stm->serial, &address, 4);
 	serial_write(stm->serial, &cs     , 1);
 
-	return stm8_read_byte(stm) == STM8_ACK;
+	ok = stm8_read_byte(stm) == STM8_ACK;
+	stm8_record(stm, STM8_STAT_GO, STM8_PHASE_ADDR, start, 0, ok);
+	return ok;
+}
+
+/*
+	the digest routine: walks a table of 8 byte entries
+
+		[0] address bits 16-22, bit 7 set to carry on from the entry before
+		[1] address bits 8-15, [2] bits 0-7
+		[3] length high, [4] low, zero ends the table
+		[5] CRC high, [6] low, [7] OR of all bytes, filled in
+
+	computing the CRC-16/CCITT of crc16() and restarting the bootloader
+	when done. Its variables are at 0x80-0x89, in the bootloader's RAM.
+*/
+static const uint8_t stm8_digest_routine[] = {
+	0x9b,                                   /* 00 start:   sim */
+	0x90,0xae,0x00,0x00,                    /* 01          ldw y,#table, patched in */
+	0x90,0xe6,0x03,                         /* 05 entry:   ld a,(3,y) */
+	0x90,0xea,0x04,                         /* 08          or a,(4,y) */
+	0x27,0x77,                              /* 0b          jreq done */
+	0x90,0xf6,                              /* 0d          ld a,(y) */
+	0x2b,0x0a,                              /* 0f          jrmi cont */
+	0x35,0xff,0x00,0x83,                    /* 11          mov 0x83,#0xff */
+	0x35,0xff,0x00,0x84,                    /* 15          mov 0x84,#0xff */
+	0x3f,0x85,                              /* 19          clr 0x85 */
+	0xa4,0x7f,                              /* 1b cont:    and a,#0x7f */
+	0xb7,0x80,                              /* 1d          ld 0x80,a */
+	0x90,0xe6,0x01,                         /* 1f          ld a,(1,y) */
+	0xb7,0x81,                              /* 22          ld 0x81,a */
+	0x90,0xe6,0x02,                         /* 24          ld a,(2,y) */
+	0xb7,0x82,                              /* 27          ld 0x82,a */
+	0x90,0xe6,0x03,                         /* 29          ld a,(3,y) */
+	0xb7,0x86,                              /* 2c          ld 0x86,a */
+	0x90,0xe6,0x04,                         /* 2e          ld a,(4,y) */
+	0xb7,0x87,                              /* 31          ld 0x87,a */
+	0x5f,                                   /* 33          clrw x */
+	0x92,0xaf,0x00,0x80,                    /* 34 byte:    ldf a,([0x80.e],x) */
+	0xb7,0x88,                              /* 38          ld 0x88,a */
+	0xba,0x85,                              /* 3a          or a,0x85 */
+	0xb7,0x85,                              /* 3c          ld 0x85,a */
+	0xb6,0x88,                              /* 3e          ld a,0x88 */
+	0xb8,0x83,                              /* 40          xor a,0x83 */
+	0xb7,0x83,                              /* 42          ld 0x83,a */
+	0x35,0x08,0x00,0x89,                    /* 44          mov 0x89,#8 */
+	0x38,0x84,                              /* 48 bit:     sll 0x84 */
+	0x39,0x83,                              /* 4a          rlc 0x83 */
+	0x24,0x0c,                              /* 4c          jrnc nox */
+	0xb6,0x83,                              /* 4e          ld a,0x83 */
+	0xa8,0x10,                              /* 50          xor a,#0x10 */
+	0xb7,0x83,                              /* 52          ld 0x83,a */
+	0xb6,0x84,                              /* 54          ld a,0x84 */
+	0xa8,0x21,                              /* 56          xor a,#0x21 */
+	0xb7,0x84,                              /* 58          ld 0x84,a */
+	0x3a,0x89,                              /* 5a nox:     dec 0x89 */
+	0x26,0xea,                              /* 5c          jrne bit */
+	0x5c,                                   /* 5e          incw x */
+	0xb6,0x87,                              /* 5f          ld a,0x87 */
+	0xa0,0x01,                              /* 61          sub a,#1 */
+	0xb7,0x87,                              /* 63          ld 0x87,a */
+	0xb6,0x86,                              /* 65          ld a,0x86 */
+	0xa2,0x00,                              /* 67          sbc a,#0 */
+	0xb7,0x86,                              /* 69          ld 0x86,a */
+	0xba,0x87,                              /* 6b          or a,0x87 */
+	0x26,0xc5,                              /* 6d          jrne byte */
+	0xb6,0x83,                              /* 6f          ld a,0x83 */
+	0x90,0xe7,0x05,                         /* 71          ld (5,y),a */
+	0xb6,0x84,                              /* 74          ld a,0x84 */
+	0x90,0xe7,0x06,                         /* 76          ld (6,y),a */
+	0xb6,0x85,                              /* 79          ld a,0x85 */
+	0x90,0xe7,0x07,                         /* 7b          ld (7,y),a */
+	0x72,0xa9,0x00,0x08,                    /* 7e          addw y,#8 */
+	0x20,0x81,                              /* 82          jra entry */
+	0xac,0x00,0x60,0x00,                    /* 84 done:    jpf 0x6000 */
+};
+
+#define STM8_DIGEST_ENTRY	8
+#define STM8_DIGEST_CHUNK	0x8000	/* a chunk stays within 64K for the 16 bit index */
+
+/* number of table entries for a region */
+static unsigned int stm8_digest_chunks(const stm8_digest_t *d) {
+	uint32_t	address = d->address, left = d->len, len;
+	unsigned int	n = 0;
+
+	for (; left; left -= len, address += len, ++n) {
+		len = 0x10000 - (address & 0xFFFF);
+		if (len > STM8_DIGEST_CHUNK) len = STM8_DIGEST_CHUNK;
+		if (len > left) len = left;
+	}
+	return n;
+}
+
+/* the routine jumped into the bootloader reset, sync with it and set it up again */
+static char stm8_resync(stm8_t *stm) {
+	uint8_t	byte;
+	int	tries;
+
+	serial_flush(stm->serial);
+	for (tries = 0; tries < 3; ++tries) {
+		stm8_send_byte(stm, STM8_CMD_INIT);
+		if (serial_read(stm->serial, &byte, 1) == SERIAL_ERR_OK && byte == STM8_ACK) {
+			stm8_send_byte(stm, byte);
+			return stm8_connect(stm);
+		}
+	}
+
+	fprintf(fp_stderr, "No answer from the bootloader after the digest routine\n");
+	return 0;
+}
+
+/*
+	the bootloader only runs after a reset if its option bytes enable it
+	or the flash is empty, that is it does not start with an INT or JPF
+*/
+char stm8_restartable(const stm8_t *stm) {
+	uint8_t	opt[2], vector;
+
+	if (!stm8_read_memory(stm, stm->dev->opt_end - 1, opt, 2) ||
+	    !stm8_read_memory(stm, stm->dev->fl_start, &vector, 1))
+		return 0;
+
+	return (opt[0] == 0x55 && opt[1] == 0xAA) || (vector != 0x82 && vector != 0xAC);
+}
+
+/*
+	compute the CRC and blank state of each region on the target, instead
+	of reading it all back. The routine and its table go above the E/W
+	routines, more regions than fit are done in turns. The bootloader is
+	started again afterwards, see stm8_restartable.
+*/
+char stm8_digest(stm8_t *stm, stm8_digest_t digest[], unsigned int count) {
+	const uint32_t	code  = stm->routine_end;
+	const uint32_t	table = code + sizeof(stm8_digest_routine);
+	const uint32_t	high  = stm->dev->ram_end + 1 - STM8_RAM_STACK_SIZE;
+	uint8_t		routine[sizeof(stm8_digest_routine)];
+	uint8_t		entries[high > table ? high - table : 1];
+	unsigned int	room = (sizeof(entries) / STM8_DIGEST_ENTRY), first, i, n, len, pos;
+	uint32_t	address, left, bytes;
+	uint8_t		*e;
+
+	if (high <= table || room < 2) {
+		fprintf(fp_stderr, "No free RAM for the digest routine\n");
+		return 0;
+	}
+	--room;		/* the terminating entry */
+
+	if (!stm8_restartable(stm)) {
+		fprintf(fp_stderr, "The bootloader is neither enabled nor the flash empty, it would not start again\n");
+		return 0;
+	}
+
+	for (first = 0; first < count; first = i) {
+		/* fill the table with as many whole regions as fit */
+		n = 0;
+		bytes = 0;
+		for (i = first; i < count && n + stm8_digest_chunks(&digest[i]) <= room; ++i) {
+			address = digest[i].address;
+			for (left = digest[i].len; left; left -= len, address += len) {
+				len = 0x10000 - (address & 0xFFFF);
+				if (len > STM8_DIGEST_CHUNK) len = STM8_DIGEST_CHUNK;
+				if (len > left) len = left;
+
+				e = &entries[n++ * STM8_DIGEST_ENTRY];
+				memset(e, 0, STM8_DIGEST_ENTRY);
+				e[0] = (address >> 16 & 0x7F) | (left != digest[i].len ? 0x80 : 0);
+				e[1] = address >> 8;
+				e[2] = address;
+				e[3] = len >> 8;
+				e[4] = len;
+			}
+			bytes += digest[i].len;
+		}
+		if (i == first) {
+			fprintf(fp_stderr, "Region 0x%08x-0x%08x is too large to digest\n",
+				digest[i].address, digest[i].address + digest[i].len - 1);
+			return 0;
+		}
+		memset(&entries[n * STM8_DIGEST_ENTRY], 0, STM8_DIGEST_ENTRY);
+
+		memcpy(routine, stm8_digest_routine, sizeof(routine));
+		routine[3] = table >> 8;
+		routine[4] = table;
+		for (pos = 0; pos < sizeof(routine); pos += len) {
+			len = sizeof(routine) - pos > 128 ? 128 : sizeof(routine) - pos;
+			if (!stm8_write_memory(stm, code + pos, &routine[pos], len))
+				return 0;
+		}
+		for (pos = 0; pos < (n + 1) * STM8_DIGEST_ENTRY; pos += len) {
+			len = (n + 1) * STM8_DIGEST_ENTRY - pos > 128 ? 128 : (n + 1) * STM8_DIGEST_ENTRY - pos;
+			if (!stm8_write_memory(stm, table + pos, &entries[pos], len))
+				return 0;
+		}
+
+		/* about 120 cycles a byte at 16MHz, then the bootloader starts up */
+		if (!stm8_go(stm, code))
+			return 0;
+		stm8_sleep(bytes * 8 + 10000);
+		if (!stm8_resync(stm))
+			return 0;
+
+		for (pos = 0; pos < n * STM8_DIGEST_ENTRY; pos += len) {
+			len = n * STM8_DIGEST_ENTRY - pos > 256 ? 256 : n * STM8_DIGEST_ENTRY - pos;
+			if (!stm8_read_memory(stm, table + pos, &entries[pos], len))
+				return 0;
+		}
+
+		/* the last entry of a region holds its result */
+		for (n = 0; first < i; ++first) {
+			n += stm8_digest_chunks(&digest[first]);
+			if (!digest[first].len) {
+				digest[first].crc   = 0xFFFF;
+				digest[first].blank = 1;
+				continue;
+			}
+			e = &entries[(n - 1) * STM8_DIGEST_ENTRY];
+			digest[first].crc   = e[5] << 8 | e[6];
+			digest[first].blank = e[7] == 0;
+		}
+	}
+
+	return 1;
+}
+
+/* the counters and latency histograms of every command and phase seen so far */
+void stm8_stats_print(const stm8_t *stm, FILE *fp) {
+	const stm8_stat_t	*st;
+	unsigned int		c, p, b;
+
+	fprintf(fp, "\n%-6s %-8s %7s %5s %9s %9s %9s  latency histogram (us: count)\n",
+		"cmd", "phase", "count", "nack", "bytes", "avg us", "max us");
+	for (c = 0; c < STM8_STAT_CMDS; ++c)
+		for (p = 0; p < STM8_PHASES; ++p) {
+			st = &stm->stats->stat[c][p];
+			if (!st->count) continue;
+
+			fprintf(fp, "%-6s %-8s %7u %5u %9llu %9llu %9u ", stm8_stat_cmds[c], stm8_phases[p],
+				st->count, st->nack, (unsigned long long)st->bytes,
+				(unsigned long long)(st->total / st->count), st->max);
+			for (b = 0; b < STM8_HIST_BINS; ++b)
+				if (st->hist[b])
+					fprintf(fp, " %u:%u", 1u << b, st->hist[b]);
+			fprintf(fp, "\n");
+		}
+	fprintf(fp, "BUSY bytes echoed: %u\n", stm->stats->busy);
+}
+
+/* for SIGUSR1, a handler must not print so the next command does */
+void stm8_stats_signal(int sig) {
+	stm8_stats_wanted = 1;
 }
 
 char stm8_reset_device(const stm8_t *stm) {
@@ -23,11 +23,31 @@
 #define _STM8_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include "serial.h"
 
+/* the erase/write routines are loaded here, the bootloader uses the RAM below */
+#define STM8_E_W_ROUTINE_ADDR	0xA0
+/* top of RAM kept free for the bootloader stack */
+#define STM8_RAM_STACK_SIZE	0x100
+
+/* a WRITE split into the frames sent after the command, see stm8_frame_write */
+#define STM8_ADDR_FRAME		5		/* address and checksum */
+#define STM8_DATA_FRAME(len)	((len) + 2)	/* N-1, data and checksum */
+
 typedef struct stm8		stm8_t;
 typedef struct stm8_cmd	stm8_cmd_t;
 typedef struct stm8_dev	stm8_dev_t;
+typedef struct stm8_digest	stm8_digest_t;
+typedef struct stm8_timing	stm8_timing_t;
+typedef struct stm8_stats	stm8_stats_t;
+
+/* the commands that keep the bootloader busy, see stm8_timing */
+typedef enum {
+	STM8_TIME_WRITE,	/* per WRITE */
+	STM8_TIME_ERASE,	/* per sector erased */
+	STM8_TIME_KINDS
+} stm8_time_t;
 
 struct stm8 {
 	const serial_t		*serial;
@@ -37,6 +57,16 @@ struct stm8 {
 	uint16_t		pid;
 	stm8_cmd_t		*cmd;
 	const stm8_dev_t	*dev;
+	uint32_t		routine_end;	/* first RAM address after the E/W routines */
+	stm8_timing_t		*timing;
+	stm8_stats_t		*stats;		/* per command counters, see stm8_stats_print */
+};
+
+/* expected times start from the device table and follow the measured ones */
+struct stm8_timing {
+	uint32_t	expect[STM8_TIME_KINDS];	/* us per unit */
+	uint64_t	spent [STM8_TIME_KINDS];	/* us measured in all */
+	uint32_t	units [STM8_TIME_KINDS];
 };
 
 struct stm8_dev {
@@ -48,15 +78,33 @@ struct stm8_dev {
 	uint16_t	fl_ps;  // page size
 	uint32_t	opt_start, opt_end;
 	uint32_t	mem_start, mem_end;
+	uint32_t	uid;	// 96 bit unique ID
+	uint32_t	t_write; // us to program a block
+	uint32_t	t_erase; // us to erase a sector
+};
+
+/* a region digested on the target by stm8_digest */
+struct stm8_digest {
+	uint32_t	address;
+	uint32_t	len;
+	uint16_t	crc;	/* as crc16(0xffff, ...) over the region */
+	char		blank;	/* all bytes zero, as erased flash reads */
 };
 
 stm8_t* stm8_init      (const serial_t *serial, const char init);
 void stm8_close         (stm8_t *stm);
 char stm8_read_memory   (const stm8_t *stm, uint32_t address, uint8_t data[], unsigned int len);
-char stm8_write_memory  (const stm8_t *stm, uint32_t address, uint8_t data[], unsigned int len);
+char stm8_write_memory  (const stm8_t *stm, uint32_t address, const uint8_t data[], unsigned int len);
+void stm8_frame_write   (uint32_t address, const uint8_t data[], unsigned int len, uint8_t addr_frame[], uint8_t data_frame[]);
+char stm8_write_framed  (const stm8_t *stm, const uint8_t addr_frame[], const uint8_t data_frame[], unsigned int len);
 char stm8_erase_memory  (const stm8_t *stm, uint8_t pages);
+char stm8_erase_sectors (const stm8_t *stm, const uint8_t sectors[], unsigned int count);
 char stm8_go            (const stm8_t *stm, uint32_t address);
 char stm8_reset_device  (const stm8_t *stm);
+char stm8_restartable   (const stm8_t *stm);
+char stm8_digest        (stm8_t *stm, stm8_digest_t digest[], unsigned int count);
+void stm8_stats_print   (const stm8_t *stm, FILE *fp);
+void stm8_stats_signal  (int sig);
 uint8_t *stm8_get_e_w_routine(int *len, char bl_version);
 
 
@@ -0,0 +1,218 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  timestamped trace of the bytes on the serial line
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	The serial functions only put their bytes into a ring, a thread of
+	its own writes them out. The ring has one producer and one consumer,
+	each moves its own index only, so no lock is needed: head is moved
+	by trace_record once an entry is filled and tail by the writer once
+	it is written.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+#define TRACE_RING	4096	/* entries, a power of two */
+#define TRACE_SLEEP	10000	/* us the writer waits for more entries */
+
+typedef struct {
+	uint64_t	time;
+	uint8_t		dir, len;
+	uint8_t		data[TRACE_CHUNK];
+} trace_entry_t;
+
+typedef struct {
+	int			fd;
+	pthread_t		thread;
+	uint64_t		start;
+	volatile unsigned int	head, tail;
+	volatile char		stop;
+	unsigned int		stalls;		/* times the ring was full */
+	trace_entry_t		ring[TRACE_RING];
+} trace_t;
+
+extern FILE *fp_stderr;
+
+static trace_t *trace;
+
+static uint64_t trace_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* write the entries from tail up to head */
+static int trace_drain(trace_t *t) {
+	uint8_t			buf[64 * (TRACE_RECORD_SIZE + TRACE_CHUNK)];
+	const trace_entry_t	*e;
+	unsigned int		head = t->head, tail = t->tail, i;
+	uint8_t			*p;
+	ssize_t			r;
+
+	__sync_synchronize();
+	while (tail != head) {
+		for (p = buf; tail != head && p + TRACE_RECORD_SIZE + TRACE_CHUNK <= buf + sizeof(buf); ++tail) {
+			e = &t->ring[tail % TRACE_RING];
+			for (i = 0; i < 8; ++i)
+				*p++ = e->time >> (8 * i);
+			*p++ = e->dir;
+			*p++ = e->len;
+			memcpy(p, e->data, e->len);
+			p += e->len;
+		}
+
+		for (i = 0; buf + i < p; i += r)
+			if ((r = write(t->fd, buf + i, p - buf - i)) < 1)
+				return 1;
+
+		__sync_synchronize();
+		t->tail = tail;
+	}
+	return 0;
+}
+
+static void* trace_writer(void *arg) {
+	trace_t	*t = arg;
+	char	stop;
+
+	for (;;) {
+		/* seen before draining, so all entries made before the stop are written */
+		stop = t->stop;
+		__sync_synchronize();
+		if (trace_drain(t) != 0) {
+			perror("trace");
+			t->stop = 1;
+		}
+		if (stop || t->stop) break;
+		usleep(TRACE_SLEEP);
+	}
+	return NULL;
+}
+
+int trace_start(const char *filename) {
+	if (!(trace = calloc(sizeof(trace_t), 1))) {
+		fprintf(fp_stderr, "Out of memory\n");
+		return 1;
+	}
+
+	trace->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace->fd < 0) {
+		perror(filename);
+		goto fail;
+	}
+	if (write(trace->fd, TRACE_MAGIC, TRACE_HEADER_SIZE) != TRACE_HEADER_SIZE) {
+		perror(filename);
+		close(trace->fd);
+		goto fail;
+	}
+
+	trace->start = trace_now();
+	if (pthread_create(&trace->thread, NULL, trace_writer, trace) != 0) {
+		fprintf(fp_stderr, "Can not start the trace writer\n");
+		close(trace->fd);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	free(trace);
+	trace = NULL;
+	return 1;
+}
+
+void trace_stop(void) {
+	trace_t *t = trace;
+
+	if (!t) return;
+	trace = NULL;
+
+	t->stop = 1;
+	pthread_join(t->thread, NULL);
+	close(t->fd);
+	if (t->stalls)
+		fprintf(fp_stderr, "The trace fell behind %u times\n", t->stalls);
+	free(t);
+}
+
+/* called by the serial functions for every transfer, does nothing without a trace */
+void trace_record(trace_dir_t dir, const void *data, unsigned int len) {
+	const uint8_t	*p = data;
+	trace_entry_t	*e;
+	uint64_t	now;
+	unsigned int	n;
+
+	if (!trace || trace->stop) return;
+
+	now = trace_now() - trace->start;
+	do {
+		n = len > TRACE_CHUNK ? TRACE_CHUNK : len;
+
+		/* the line is far slower than the disk, a full ring is a hiccup, unless the writer gave up */
+		while (trace->head - trace->tail == TRACE_RING && !trace->stop) {
+			++trace->stalls;
+			usleep(1000);
+		}
+		if (trace->stop) return;
+
+		e	= &trace->ring[trace->head % TRACE_RING];
+		e->time = now;
+		e->dir	= dir;
+		e->len	= n;
+		memcpy(e->data, p, n);
+		__sync_synchronize();
+		++trace->head;
+
+		p   += n;
+		len -= n;
+	} while (len);
+
+	/* a timeout is usually followed by an assert, get the trace on disk first */
+	if (dir == TRACE_IDLE)
+		while (trace->head != trace->tail && !trace->stop)
+			usleep(1000);
+}
+
+/* the next record of a trace file, 1 at its end and -1 if it is damaged */
+int trace_read(FILE *fp, trace_rec_t *rec) {
+	uint8_t		head[TRACE_RECORD_SIZE];
+	unsigned int	i;
+	size_t		got;
+
+	if ((got = fread(head, 1, sizeof(head), fp)) != sizeof(head))
+		return got == 0 && !ferror(fp) ? 1 : -1;
+
+	for (rec->time = 0, i = 0; i < 8; ++i)
+		rec->time |= (uint64_t)head[i] << (8 * i);
+	rec->dir = head[8];
+	rec->len = head[9];
+	if (rec->dir > TRACE_IDLE || rec->len > TRACE_CHUNK ||
+	    fread(rec->data, 1, rec->len, fp) != rec->len)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,62 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  timestamped trace of the bytes on the serial line
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+	A trace file is the magic followed by one record per transfer, all
+	numbers little endian:
+
+		time	8	microseconds since the trace was started
+		dir	1	a trace_dir_t
+		len	1	bytes following, at most TRACE_CHUNK
+		data	len
+
+	longer transfers are split into records of the same time.
+*/
+#define TRACE_MAGIC		"STM8TRC1"
+#define TRACE_HEADER_SIZE	8
+#define TRACE_RECORD_SIZE	10	/* without the data */
+#define TRACE_CHUNK		32
+
+typedef enum {
+	TRACE_OUT,	/* host to device */
+	TRACE_IN,	/* device to host */
+	TRACE_IDLE	/* a read timed out without data */
+} trace_dir_t;
+
+typedef struct {
+	uint64_t	time;
+	trace_dir_t	dir;
+	unsigned int	len;
+	uint8_t		data[TRACE_CHUNK];
+} trace_rec_t;
+
+int  trace_start (const char *filename);
+void trace_stop  (void);
+void trace_record(trace_dir_t dir, const void *data, unsigned int len);
+
+int  trace_read  (FILE *fp, trace_rec_t *rec);
+
+#endif
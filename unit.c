@@ -0,0 +1,193 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  record of the flash contents last written to each device
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	One text file per device, named after its unique ID:
+
+		hash <image hash>
+		<block address> <block crc>
+		...
+
+	The record is removed before the flash of the device is changed and
+	written again once a full write went through, so a record that exists
+	can be trusted as far as this host is concerned.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "unit.h"
+
+extern FILE *fp_stderr;
+
+static int unit_load(unit_t *unit, FILE *fp) {
+	char		line[64];
+	unsigned long	address, crc;
+	unsigned int	alloc = 0;
+	unit_block_t	*p;
+	char		*end;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, "hash ", 5)) {
+			unit->hash = strtoull(line + 5, NULL, 16);
+			continue;
+		}
+
+		address = strtoul(line, &end, 16);
+		crc     = strtoul(end, &end, 16);
+		if (*end != '\n' || crc > 0xFFFF ||
+		    (unit->count && address <= unit->block[unit->count - 1].address))
+			return 1;
+
+		if (unit->count == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			if (!(p = realloc(unit->block, alloc * sizeof(*p))))
+				return 1;
+			unit->block = p;
+		}
+		unit->block[unit->count].address = address;
+		unit->block[unit->count].crc	 = crc;
+		unit->block[unit->count].same	 = 0;
+		++unit->count;
+	}
+
+	return ferror(fp) || !unit->hash || unit->hash != unit_hash(unit->block, unit->count);
+}
+
+/* the record of a device, without blocks and hash if there is none yet */
+unit_t* unit_open(const char *dir, const uint8_t id[UNIT_ID_LEN]) {
+	unit_t		*unit;
+	unsigned int	i;
+	FILE		*fp;
+
+	if (!(unit = calloc(sizeof(unit_t), 1))) {
+		fprintf(fp_stderr, "Out of memory\n");
+		return NULL;
+	}
+
+	for (i = 0; i < UNIT_ID_LEN; ++i)
+		sprintf(&unit->id[2 * i], "%02x", id[i]);
+	if (snprintf(unit->path, sizeof(unit->path), "%s/%s.unit", dir, unit->id) >= (int)sizeof(unit->path)) {
+		fprintf(fp_stderr, "Unit record path too long\n");
+		free(unit);
+		return NULL;
+	}
+
+	if (!(fp = fopen(unit->path, "r"))) {
+		if (errno == ENOENT)
+			return unit;
+		perror(unit->path);
+		free(unit);
+		return NULL;
+	}
+
+	/* a damaged record is as good as none, the next full write replaces it */
+	if (unit_load(unit, fp) != 0) {
+		fprintf(fp_stderr, "Ignoring damaged unit record %s\n", unit->path);
+		free(unit->block);
+		unit->block = NULL;
+		unit->count = 0;
+		unit->hash  = 0;
+	}
+	fclose(fp);
+	return unit;
+}
+
+void unit_free(unit_t *unit) {
+	if (unit) free(unit->block);
+	free(unit);
+}
+
+/* the flash is about to change in ways the record does not follow */
+int unit_forget(unit_t *unit) {
+	if (unlink(unit->path) != 0 && errno != ENOENT) {
+		perror(unit->path);
+		return 1;
+	}
+	return 0;
+}
+
+/* replace the record with the blocks of a full write, block is taken over */
+int unit_save(unit_t *unit, unit_block_t *block, unsigned int count) {
+	char		tmp[UNIT_PATH_MAX + 16];
+	unsigned int	i;
+	FILE		*fp;
+
+	free(unit->block);
+	unit->block = block;
+	unit->count = count;
+	unit->hash  = unit_hash(block, count);
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", unit->path, (int)getpid());
+	if (!(fp = fopen(tmp, "w"))) {
+		perror(tmp);
+		return 1;
+	}
+
+	fprintf(fp, "hash %016llx\n", (unsigned long long)unit->hash);
+	for (i = 0; i < count; ++i)
+		fprintf(fp, "%06x %04x\n", block[i].address, block[i].crc);
+
+	if (ferror(fp) | fclose(fp) || rename(tmp, unit->path) != 0) {
+		perror(unit->path);
+		unlink(tmp);
+		return 1;
+	}
+	return 0;
+}
+
+/* 64 bit FNV-1a over the addresses and checksums, never 0 */
+uint64_t unit_hash(const unit_block_t *block, unsigned int count) {
+	uint64_t	hash = 0xcbf29ce484222325ULL;
+	uint8_t		b[6];
+	unsigned int	i, j;
+
+	for (i = 0; i < count; ++i) {
+		b[0] = block[i].address >> 24;
+		b[1] = block[i].address >> 16;
+		b[2] = block[i].address >> 8;
+		b[3] = block[i].address;
+		b[4] = block[i].crc >> 8;
+		b[5] = block[i].crc;
+		for (j = 0; j < sizeof(b); ++j)
+			hash = (hash ^ b[j]) * 0x100000001b3ULL;
+	}
+
+	return hash ? hash : 1;
+}
+
+unit_block_t* unit_find(unit_block_t *block, unsigned int count, uint32_t address) {
+	unsigned int lo = 0, hi = count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (block[mid].address == address)
+			return &block[mid];
+		if (block[mid].address < address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
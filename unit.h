@@ -0,0 +1,58 @@
+/*
+  stm8flash - Open Source ST STM8 flash program for *nix
+  record of the flash contents last written to each device
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _UNIT_H
+#define _UNIT_H
+
+#include <stdint.h>
+
+#define UNIT_ID_LEN	12	/* bytes of the unique ID */
+#define UNIT_BLOCK	128	/* flash block the checksums are kept for */
+#define UNIT_PATH_MAX	4096
+
+typedef struct unit_block unit_block_t;
+typedef struct unit       unit_t;
+
+struct unit_block {
+	uint32_t	address;
+	uint16_t	crc;	/* of the whole block, zero where the image has no data */
+	char		same;	/* the flash holds it already, set when planning a write */
+};
+
+/*
+	a record lists the blocks of the last full write, the rest of the
+	flash was erased by it. It is kept as "<dir>/<unique ID>.unit"
+*/
+struct unit {
+	char		path[UNIT_PATH_MAX];
+	char		id[2 * UNIT_ID_LEN + 1];
+	uint64_t	hash;		/* of the blocks, 0 without a record */
+	unit_block_t	*block;		/* sorted by address */
+	unsigned int	count;
+};
+
+unit_t*       unit_open  (const char *dir, const uint8_t id[UNIT_ID_LEN]);
+void          unit_free  (unit_t *unit);
+int           unit_forget(unit_t *unit);
+int           unit_save  (unit_t *unit, unit_block_t *block, unsigned int count);
+uint64_t      unit_hash  (const unit_block_t *block, unsigned int count);
+unit_block_t* unit_find  (unit_block_t *block, unsigned int count, uint32_t address);
+
+#endif
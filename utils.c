@@ -35,3 +35,14 @@ uint32_t be_u32(const uint32_t v) {
 	return v;
 }
 
+/* CRC-16/CCITT (polynomial 0x1021), start with 0xFFFF */
+uint16_t crc16(uint16_t crc, const uint8_t *data, unsigned int len) {
+	int i;
+
+	while (len--) {
+		crc ^= *data++ << 8;
+		for (i = 0; i < 8; ++i)
+			crc = crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
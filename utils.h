@@ -25,5 +25,6 @@
 
 char     cpu_le();
 uint32_t be_u32(const uint32_t v);
+uint16_t crc16 (uint16_t crc, const uint8_t *data, unsigned int len);
 
 #endif